@@ -16,7 +16,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include "archive.h"
 
@@ -29,8 +31,11 @@
 #define OFF_MAGIC       0x101
 #define LEN_PATH        100
 
+/* headers and small files are read through a buffer, the rest directly */
+#define BUF_SIZE        65536
+
 int
-archive_open(Archive_reader **rar, FILE *in)
+archive_open(Archive_reader **rar, int fd)
 {
     Archive_reader *ar;
 
@@ -39,7 +44,15 @@ archive_open(Archive_reader **rar, FILE *in)
         perror("malloc");
         return -1;
     }
-    ar->in = in;
+    ar->buf = malloc(BUF_SIZE);
+    if (ar->buf == NULL) {
+        perror("malloc");
+        free(ar);
+        return -1;
+    }
+    ar->fd = fd;
+    ar->buf_pos = ar->buf_end = 0;
+    ar->offset = 0;
     ar->toread = 0;
     ar->long_filename_buf = NULL;
     ar->long_filename_buf_size = 0;
@@ -51,6 +64,7 @@ void
 archive_free(Archive_reader **rar)
 {
     free((*rar)->long_filename_buf);
+    free((*rar)->buf);
     free(*rar);
     *rar = NULL;
 }
@@ -95,8 +109,67 @@ get_mtime(const uint8_t *head)
     return get_oct(head + OFF_MTIME, 12);
 }
 
+static ssize_t
+read_retry(int fd, uint8_t *buf, size_t size)
+{
+    ssize_t r;
+
+    do
+        r = read(fd, buf, size);
+    while (r < 0 && errno == EINTR);
+    return r;
+}
+
+/*
+ * Read up to size bytes; large reads bypass the buffer when it is
+ * empty, so that file data goes directly to its destination.
+ */
+static ssize_t
+read_some(Archive_reader *ar, uint8_t *buf, size_t size)
+{
+    ssize_t r;
+
+    if (ar->buf_pos == ar->buf_end) {
+        if (size >= BUF_SIZE) {
+            r = read_retry(ar->fd, buf, size);
+            if (r > 0)
+                ar->offset += r;
+            return r;
+        }
+        r = read_retry(ar->fd, ar->buf, BUF_SIZE);
+        if (r <= 0)
+            return r;
+        ar->buf_pos = 0;
+        ar->buf_end = r;
+    }
+    if (size > ar->buf_end - ar->buf_pos)
+        size = ar->buf_end - ar->buf_pos;
+    memcpy(buf, ar->buf + ar->buf_pos, size);
+    ar->buf_pos += size;
+    ar->offset += size;
+    return size;
+}
+
+/* Read size bytes, less only at the end of the file. */
+static ssize_t
+read_full(Archive_reader *ar, uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    ssize_t r;
+
+    while (done < size) {
+        r = read_some(ar, buf + done, size - done);
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
 #define ATOFF " at offset 0x%jx\n"
-#define OFFAT(d) (uintmax_t)(ftello(ar->in) - (d))
+#define OFFAT(d) (uintmax_t)(ar->offset - (d))
 #define ATOFFSET(d) ATOFF, OFFAT(d)
 
 static int
@@ -128,7 +201,7 @@ read_long_something(Archive_reader *ar, uint8_t *head,
         *buf = n;
         *buf_size = bsize;
     }
-    ret = fread(*buf, 1, bsize, ar->in);
+    ret = read_full(ar, (uint8_t *)*buf, bsize);
     if (ret != (int)bsize) {
         if (ret < 0)
             fprintf(stderr, "Read error in tar file" ATOFFSET(0));
@@ -166,12 +239,11 @@ archive_next(Archive_reader *ar)
     ar->filename = ar->filename_buf;
     ar->target = ar->target_buf;
     while (1) {
-        ret = fread(head, 1, sizeof(head), ar->in);
-        if (ret == 0) {
-            if (ferror(ar->in) || !feof(ar->in)) {
-                fprintf(stderr, "Read error in tar file" ATOFFSET(0));
-                return -1;
-            }
+        ret = read_full(ar, head, sizeof(head));
+        if (ret < 0) {
+            fprintf(stderr, "Read error in tar file" ATOFFSET(0));
+            return -1;
+        } else if (ret == 0) {
             return 0;
         } else if (ret < (int)sizeof(head)) {
             fprintf(stderr, "Truncated tar file" ATOFFSET(0));
@@ -250,20 +322,28 @@ archive_read(Archive_reader *ar, uint8_t *buf, int size)
         return 0;
     if ((uint64_t)size > ar->toread)
         size = ar->toread;
-    ret = fread(buf, 1, size, ar->in);
-    /* TODO read errors */
-    if (ret < size)
-        return -1;
+    ret = read_some(ar, buf, size);
+    if (ret <= 0)
+        goto fail;
+    size = ret;
     ar->toread -= size;
     if (ar->toread == 0) {
         pad = 512 - (ar->size & 511);
         if (pad < 512) {
-            ret = fread(padbuf, 1, pad, ar->in);
-            if (ret < (int)pad)
-                return -1;
+            ret = read_full(ar, padbuf, pad);
+            if (ret != (int)pad)
+                goto fail;
         }
     }
     return size;
+
+fail:
+    if (ret < 0)
+        fprintf(stderr, "Read error in tar file: %s" ATOFF,
+            strerror(errno), OFFAT(0));
+    else
+        fprintf(stderr, "Truncated tar file" ATOFFSET(0));
+    return -1;
 }
 
 #if 0
@@ -274,7 +354,7 @@ main(void)
     Archive_reader *ar;
     int ret;
 
-    if (archive_open(&ar, stdin) < 0)
+    if (archive_open(&ar, 0) < 0)
         exit(1);
     while (1) {
         printf("\n");
@@ -15,7 +15,11 @@
 typedef struct Archive_reader Archive_reader;
 
 struct Archive_reader {
-    FILE *in;
+    int fd;
+    uint8_t *buf;
+    unsigned buf_pos;
+    unsigned buf_end;
+    uint64_t offset;
     char *filename;
     char *target;
     uint64_t toread;
@@ -31,7 +35,11 @@ struct Archive_reader {
     char type;
 };
 
-int archive_open(Archive_reader **rar, FILE *in);
+/**
+ * Read a tar archive from fd; the data of large files is read directly
+ * into the buffers given to archive_read(), without copy.
+ */
+int archive_open(Archive_reader **rar, int fd);
 
 void archive_free(Archive_reader **rar);
 
@@ -0,0 +1,559 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "blake3.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# define HAVE_X86_VECTORS 1
+#endif
+
+#define CHUNK_LEN 1024
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END   (1 << 1)
+#define PARENT      (1 << 2)
+#define ROOT        (1 << 3)
+
+/* Subtrees up to that many chunks are hashed with their CVs on the stack */
+#define LEAF_CHUNKS 64
+/* Subtrees are not split between threads below that many chunks */
+#define MIN_PIECE_CHUNKS 256
+#define MAX_PIECES 64
+
+static const uint32_t blake3_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint8_t blake3_schedule[7][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    {  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+    {  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+    { 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+    { 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+    {  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+    { 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 },
+};
+
+typedef void (*Hash_many)(const uint8_t *input, size_t stride,
+    unsigned nb_blocks, uint64_t counter, int inc_counter, uint32_t flags,
+    uint32_t flags_start, uint32_t flags_end, uint8_t *out);
+
+typedef struct Blake3_task Blake3_task;
+struct Blake3_task {
+    Blake3_task *next;
+    const uint8_t *input;
+    size_t nb_chunks;
+    uint64_t counter;
+    uint8_t *out;
+    unsigned *pending;
+};
+
+/*
+ * Helper threads shared by all the hashers, started on first use;
+ * a thread waiting for its tasks runs pending tasks in the meantime.
+ */
+typedef struct Blake3_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_task;
+    pthread_cond_t cond_done;
+    Blake3_task *queue;
+    unsigned nb_threads;
+} Blake3_pool;
+
+static pthread_once_t blake3_once = PTHREAD_ONCE_INIT;
+static pthread_once_t blake3_pool_once = PTHREAD_ONCE_INIT;
+
+static Hash_many blake3_hash_many;
+static unsigned blake3_lanes;
+
+static Blake3_pool blake3_pool;
+
+static inline uint32_t
+rd_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+        (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void
+wr_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define LANES 4
+#define FN(name) name ## _x4
+#define TARGET
+#include "blake3_template.c"
+#undef LANES
+#undef FN
+#undef TARGET
+
+#ifdef HAVE_X86_VECTORS
+
+#define LANES 8
+#define FN(name) name ## _x8
+#define TARGET __attribute__((target("avx2")))
+#include "blake3_template.c"
+#undef LANES
+#undef FN
+#undef TARGET
+
+#define LANES 16
+#define FN(name) name ## _x16
+#define TARGET __attribute__((target("avx512f")))
+#include "blake3_template.c"
+#undef LANES
+#undef FN
+#undef TARGET
+
+#endif
+
+#define G(a, b, c, d, x, y) \
+    a = a + b + x; d = ROTR(d ^ a, 16); \
+    c = c + d;     b = ROTR(b ^ c, 12); \
+    a = a + b + y; d = ROTR(d ^ a,  8); \
+    c = c + d;     b = ROTR(b ^ c,  7);
+
+static void
+blake3_compress(const uint32_t cv[8], const uint8_t *block,
+    uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[8])
+{
+    uint32_t v[16], m[16];
+    const uint8_t *s;
+    unsigned i, r;
+
+    for (i = 0; i < 16; i++)
+        m[i] = rd_le32(block + i * 4);
+    for (i = 0; i < 8; i++)
+        v[i] = cv[i];
+    for (i = 0; i < 4; i++)
+        v[8 + i] = blake3_iv[i];
+    v[12] = counter;
+    v[13] = counter >> 32;
+    v[14] = block_len;
+    v[15] = flags;
+    for (r = 0; r < 7; r++) {
+        s = blake3_schedule[r];
+        G(v[0], v[4], v[ 8], v[12], m[s[ 0]], m[s[ 1]])
+        G(v[1], v[5], v[ 9], v[13], m[s[ 2]], m[s[ 3]])
+        G(v[2], v[6], v[10], v[14], m[s[ 4]], m[s[ 5]])
+        G(v[3], v[7], v[11], v[15], m[s[ 6]], m[s[ 7]])
+        G(v[0], v[5], v[10], v[15], m[s[ 8]], m[s[ 9]])
+        G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]])
+        G(v[2], v[7], v[ 8], v[13], m[s[12]], m[s[13]])
+        G(v[3], v[4], v[ 9], v[14], m[s[14]], m[s[15]])
+    }
+    for (i = 0; i < 8; i++)
+        out[i] = v[i] ^ v[i + 8];
+}
+
+static void
+blake3_store_cv(uint8_t *out, const uint32_t cv[8])
+{
+    unsigned i;
+
+    for (i = 0; i < 8; i++)
+        wr_le32(out + i * 4, cv[i]);
+}
+
+static void
+blake3_parent_cv(const uint8_t *block, uint32_t flags, uint8_t *out)
+{
+    uint32_t cv[8];
+
+    blake3_compress(blake3_iv, block, 0, 64, PARENT | flags, cv);
+    blake3_store_cv(out, cv);
+}
+
+static void
+blake3_chunk_cvs(const uint8_t *input, size_t nb_chunks, uint64_t counter,
+    uint8_t *out)
+{
+    uint32_t cv[8];
+    unsigned i;
+
+    for (; nb_chunks >= blake3_lanes; nb_chunks -= blake3_lanes) {
+        blake3_hash_many(input, CHUNK_LEN, CHUNK_LEN / 64, counter, 1, 0,
+            CHUNK_START, CHUNK_END, out);
+        input += blake3_lanes * CHUNK_LEN;
+        counter += blake3_lanes;
+        out += blake3_lanes * 32;
+    }
+    for (; nb_chunks > 0; nb_chunks--) {
+        memcpy(cv, blake3_iv, sizeof(cv));
+        for (i = 0; i < CHUNK_LEN / 64; i++)
+            blake3_compress(cv, input + i * 64, counter, 64,
+                (i == 0 ? CHUNK_START : 0) |
+                (i == CHUNK_LEN / 64 - 1 ? CHUNK_END : 0), cv);
+        blake3_store_cv(out, cv);
+        input += CHUNK_LEN;
+        counter++;
+        out += 32;
+    }
+}
+
+/* Can work in place: each batch is read before being written. */
+static void
+blake3_parent_cvs(const uint8_t *input, size_t nb, uint8_t *out)
+{
+    for (; nb >= blake3_lanes; nb -= blake3_lanes) {
+        blake3_hash_many(input, 64, 1, 0, 0, PARENT, 0, 0, out);
+        input += blake3_lanes * 64;
+        out += blake3_lanes * 32;
+    }
+    for (; nb > 0; nb--) {
+        blake3_parent_cv(input, 0, out);
+        input += 64;
+        out += 32;
+    }
+}
+
+/* CV of a complete subtree; nb_chunks must be a power of 2. */
+static void
+blake3_subtree_cv(const uint8_t *input, size_t nb_chunks, uint64_t counter,
+    uint8_t *out)
+{
+    uint8_t cvs[LEAF_CHUNKS * 32];
+    size_t half = nb_chunks / 2;
+
+    if (nb_chunks > LEAF_CHUNKS) {
+        blake3_subtree_cv(input, half, counter, cvs);
+        blake3_subtree_cv(input + half * CHUNK_LEN, half, counter + half,
+            cvs + 32);
+        blake3_parent_cv(cvs, 0, out);
+        return;
+    }
+    blake3_chunk_cvs(input, nb_chunks, counter, cvs);
+    for (; nb_chunks > 1; nb_chunks /= 2)
+        blake3_parent_cvs(cvs, nb_chunks / 2, cvs);
+    memcpy(out, cvs, 32);
+}
+
+static void
+blake3_run_task(Blake3_task *task)
+{
+    blake3_subtree_cv(task->input, task->nb_chunks, task->counter,
+        task->out);
+}
+
+/* called with the mutex held */
+static void
+blake3_pool_done(Blake3_pool *pool, Blake3_task *task)
+{
+    if (--*task->pending == 0)
+        pthread_cond_broadcast(&pool->cond_done);
+}
+
+static void *
+blake3_pool_thread(void *pool_v)
+{
+    Blake3_pool *pool = pool_v;
+    Blake3_task *task;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        task = pool->queue;
+        if (task == NULL) {
+            pthread_cond_wait(&pool->cond_task, &pool->mutex);
+            continue;
+        }
+        pool->queue = task->next;
+        pthread_mutex_unlock(&pool->mutex);
+        blake3_run_task(task);
+        pthread_mutex_lock(&pool->mutex);
+        blake3_pool_done(pool, task);
+    }
+    return NULL;
+}
+
+static void
+blake3_pool_start(void)
+{
+    Blake3_pool *pool = &blake3_pool;
+    pthread_attr_t attr;
+    pthread_t thread;
+    long nb_cpu;
+    unsigned i;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond_task, NULL);
+    pthread_cond_init(&pool->cond_done, NULL);
+    pool->queue = NULL;
+    pool->nb_threads = 0;
+    nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_cpu > MAX_PIECES)
+        nb_cpu = MAX_PIECES;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 1; (long)i < nb_cpu; i++) {
+        if (pthread_create(&thread, &attr, blake3_pool_thread, pool) != 0)
+            break;
+        pool->nb_threads++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * CVs of the two halves of a complete subtree; large subtrees are split
+ * in pieces hashed by the pool.
+ */
+static void
+blake3_subtree_pair(const uint8_t *input, size_t nb_chunks, uint64_t counter,
+    uint8_t *out)
+{
+    Blake3_pool *pool = &blake3_pool;
+    Blake3_task tasks[MAX_PIECES];
+    uint8_t cvs[MAX_PIECES * 32];
+    size_t nb_pieces = 1, piece;
+    unsigned i, pending;
+
+    pthread_once(&blake3_pool_once, blake3_pool_start);
+    while (nb_pieces * 2 <= pool->nb_threads + 1 &&
+        nb_chunks / (nb_pieces * 2) >= MIN_PIECE_CHUNKS)
+        nb_pieces *= 2;
+    if (nb_pieces < 2) {
+        piece = nb_chunks / 2;
+        blake3_subtree_cv(input, piece, counter, out);
+        blake3_subtree_cv(input + piece * CHUNK_LEN, piece, counter + piece,
+            out + 32);
+        return;
+    }
+    piece = nb_chunks / nb_pieces;
+    pending = nb_pieces - 1;
+    for (i = 0; i < nb_pieces; i++) {
+        tasks[i].input = input + i * piece * CHUNK_LEN;
+        tasks[i].nb_chunks = piece;
+        tasks[i].counter = counter + i * piece;
+        tasks[i].out = cvs + i * 32;
+        tasks[i].pending = &pending;
+        tasks[i].next = i + 1 < nb_pieces ? &tasks[i + 1] : NULL;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    tasks[nb_pieces - 1].next = pool->queue;
+    pool->queue = &tasks[1];
+    pthread_cond_broadcast(&pool->cond_task);
+    pthread_mutex_unlock(&pool->mutex);
+    blake3_run_task(&tasks[0]);
+    pthread_mutex_lock(&pool->mutex);
+    while (pending > 0) {
+        Blake3_task *task = pool->queue;
+
+        if (task == NULL) {
+            pthread_cond_wait(&pool->cond_done, &pool->mutex);
+            continue;
+        }
+        pool->queue = task->next;
+        pthread_mutex_unlock(&pool->mutex);
+        blake3_run_task(task);
+        pthread_mutex_lock(&pool->mutex);
+        blake3_pool_done(pool, task);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    for (; nb_pieces > 2; nb_pieces /= 2)
+        blake3_parent_cvs(cvs, nb_pieces / 2, cvs);
+    memcpy(out, cvs, 64);
+}
+
+static void
+blake3_setup_once(void)
+{
+    blake3_hash_many = hash_many_x4;
+    blake3_lanes = 4;
+#ifdef HAVE_X86_VECTORS
+    if (getenv("MULTIHASH_GENERIC") == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            blake3_hash_many = hash_many_x16;
+            blake3_lanes = 16;
+        } else if (__builtin_cpu_supports("avx2")) {
+            blake3_hash_many = hash_many_x8;
+            blake3_lanes = 8;
+        }
+    }
+#endif
+}
+
+void
+blake3_setup(void)
+{
+    pthread_once(&blake3_once, blake3_setup_once);
+}
+
+static void
+blake3_chunk_reset(Blake3_state *s, uint64_t counter)
+{
+    memcpy(s->cv, blake3_iv, sizeof(s->cv));
+    s->chunk_counter = counter;
+    s->buf_len = 0;
+    s->blocks_compressed = 0;
+}
+
+static size_t
+blake3_chunk_len(const Blake3_state *s)
+{
+    return s->blocks_compressed * 64 + s->buf_len;
+}
+
+static void
+blake3_chunk_update(Blake3_state *s, const uint8_t *buf, size_t size)
+{
+    size_t n;
+
+    while (size > 0) {
+        /* the last block of the chunk is kept for its CHUNK_END flag */
+        if (s->buf_len == 64) {
+            blake3_compress(s->cv, s->buf, s->chunk_counter, 64,
+                s->blocks_compressed == 0 ? CHUNK_START : 0, s->cv);
+            s->blocks_compressed++;
+            s->buf_len = 0;
+        }
+        n = 64 - s->buf_len;
+        if (n > size)
+            n = size;
+        memcpy(s->buf + s->buf_len, buf, n);
+        s->buf_len += n;
+        buf += n;
+        size -= n;
+    }
+}
+
+static void
+blake3_chunk_cv(Blake3_state *s, uint32_t flags, uint32_t out[8])
+{
+    memset(s->buf + s->buf_len, 0, 64 - s->buf_len);
+    blake3_compress(s->cv, s->buf, s->chunk_counter, s->buf_len,
+        (s->blocks_compressed == 0 ? CHUNK_START : 0) | CHUNK_END | flags,
+        out);
+}
+
+/*
+ * Merge the stack down to one entry per bit of the number of chunks;
+ * merging is delayed until more input shows that the root is not there.
+ */
+static void
+blake3_merge_stack(Blake3_state *s, uint64_t total_chunks)
+{
+    unsigned len = __builtin_popcountll(total_chunks);
+    uint8_t *block;
+
+    while (s->cv_stack_len > len) {
+        block = s->cv_stack + (s->cv_stack_len - 2) * 32;
+        blake3_parent_cv(block, 0, block);
+        s->cv_stack_len--;
+    }
+}
+
+static void
+blake3_push_cv(Blake3_state *s, const uint8_t *cv, uint64_t counter)
+{
+    blake3_merge_stack(s, counter);
+    memcpy(s->cv_stack + s->cv_stack_len * 32, cv, 32);
+    s->cv_stack_len++;
+}
+
+void
+blake3_init(Blake3_state *s)
+{
+    blake3_chunk_reset(s, 0);
+    s->cv_stack_len = 0;
+}
+
+void
+blake3_update(Blake3_state *s, const uint8_t *buf, size_t size)
+{
+    uint8_t pair[64];
+    uint32_t cv[8];
+    size_t n;
+
+    if (blake3_chunk_len(s) > 0) {
+        n = CHUNK_LEN - blake3_chunk_len(s);
+        if (n > size)
+            n = size;
+        blake3_chunk_update(s, buf, n);
+        buf += n;
+        size -= n;
+        if (size == 0)
+            return;
+        blake3_chunk_cv(s, 0, cv);
+        blake3_store_cv(pair, cv);
+        blake3_push_cv(s, pair, s->chunk_counter);
+        blake3_chunk_reset(s, s->chunk_counter + 1);
+    }
+    /* the last chunk is kept in the state, it may be the root */
+    while (size > CHUNK_LEN) {
+        n = (size_t)1 << (63 - __builtin_clzll(size));
+        while (((n / CHUNK_LEN - 1) & s->chunk_counter) != 0)
+            n /= 2;
+        if (n == CHUNK_LEN) {
+            blake3_chunk_cvs(buf, 1, s->chunk_counter, pair);
+            blake3_push_cv(s, pair, s->chunk_counter);
+        } else {
+            blake3_subtree_pair(buf, n / CHUNK_LEN, s->chunk_counter, pair);
+            blake3_push_cv(s, pair, s->chunk_counter);
+            blake3_push_cv(s, pair + 32, s->chunk_counter + n / CHUNK_LEN / 2);
+        }
+        s->chunk_counter += n / CHUNK_LEN;
+        buf += n;
+        size -= n;
+    }
+    if (size > 0) {
+        blake3_chunk_update(s, buf, size);
+        blake3_merge_stack(s, s->chunk_counter);
+    }
+}
+
+void
+blake3_final(Blake3_state *s, uint8_t *out)
+{
+    uint8_t block[64];
+    uint32_t cv[8];
+    unsigned i;
+
+    if (s->cv_stack_len == 0) {
+        blake3_chunk_cv(s, ROOT, cv);
+        blake3_store_cv(out, cv);
+        return;
+    }
+    i = s->cv_stack_len;
+    if (blake3_chunk_len(s) > 0) {
+        blake3_chunk_cv(s, 0, cv);
+        blake3_store_cv(block + 32, cv);
+    } else {
+        i--;
+        memcpy(block + 32, s->cv_stack + i * 32, 32);
+    }
+    while (i > 0) {
+        i--;
+        memcpy(block, s->cv_stack + i * 32, 32);
+        if (i == 0)
+            break;
+        blake3_parent_cv(block, 0, block + 32);
+    }
+    blake3_compress(blake3_iv, block, 0, 64, PARENT | ROOT, cv);
+    blake3_store_cv(out, cv);
+}
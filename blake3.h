@@ -0,0 +1,42 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * BLAKE3 with a 256-bits output. Large updates are split in subtrees
+ * hashed with SIMD and on a pool of helper threads.
+ */
+
+#define BLAKE3_MAX_DEPTH 54
+
+typedef struct Blake3_state {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t buf[64];
+    uint8_t buf_len;
+    uint8_t blocks_compressed;
+    uint8_t cv_stack_len;
+    uint8_t cv_stack[(BLAKE3_MAX_DEPTH + 1) * 32];
+} Blake3_state;
+
+/**
+ * Select the best implementation for the running CPU;
+ * must be called before the other functions, can be called several times.
+ */
+void blake3_setup(void);
+
+void blake3_init(Blake3_state *s);
+
+void blake3_update(Blake3_state *s, const uint8_t *buf, size_t size);
+
+void blake3_final(Blake3_state *s, uint8_t *out);
@@ -0,0 +1,95 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * Included by blake3.c once per vector width, with LANES, FN() and
+ * TARGET defined.
+ */
+
+typedef uint32_t FN(vec) __attribute__((vector_size(LANES * 4)));
+#define V FN(vec)
+
+#define VG(a, b, c, d, x, y) \
+    a = a + b + x; d = ROTR(d ^ a, 16); \
+    c = c + d;     b = ROTR(b ^ c, 12); \
+    a = a + b + y; d = ROTR(d ^ a,  8); \
+    c = c + d;     b = ROTR(b ^ c,  7);
+
+/*
+ * Hash one input per lane: nb_blocks consecutive blocks starting at
+ * input + lane * stride; the CVs are stored consecutively in out.
+ */
+TARGET static void
+FN(hash_many)(const uint8_t *input, size_t stride, unsigned nb_blocks,
+    uint64_t counter, int inc_counter, uint32_t flags,
+    uint32_t flags_start, uint32_t flags_end, uint8_t *out)
+{
+    uint32_t t[16][LANES] __attribute__((aligned(64)));
+    uint32_t lo[LANES], hi[LANES];
+    V h[8], v[16], m[16], ctr_lo, ctr_hi;
+    const uint8_t *p;
+    unsigned b, i, l, r;
+    uint32_t fl;
+
+    for (l = 0; l < LANES; l++) {
+        lo[l] = counter + (inc_counter ? l : 0);
+        hi[l] = (counter + (inc_counter ? l : 0)) >> 32;
+    }
+    memcpy(&ctr_lo, lo, sizeof(ctr_lo));
+    memcpy(&ctr_hi, hi, sizeof(ctr_hi));
+    for (i = 0; i < 8; i++)
+        h[i] = (V){ 0 } + blake3_iv[i];
+    for (b = 0; b < nb_blocks; b++) {
+        for (l = 0; l < LANES; l++) {
+            p = input + l * stride + b * 64;
+            for (i = 0; i < 16; i++)
+                t[i][l] = rd_le32(p + i * 4);
+        }
+        memcpy(m, t, sizeof(t));
+        fl = flags;
+        if (b == 0)
+            fl |= flags_start;
+        if (b == nb_blocks - 1)
+            fl |= flags_end;
+        for (i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (i = 0; i < 4; i++)
+            v[8 + i] = (V){ 0 } + blake3_iv[i];
+        v[12] = ctr_lo;
+        v[13] = ctr_hi;
+        v[14] = (V){ 0 } + 64;
+        v[15] = (V){ 0 } + fl;
+#pragma GCC unroll 7
+        for (r = 0; r < 7; r++) {
+            const uint8_t *s = blake3_schedule[r];
+            VG(v[0], v[4], v[ 8], v[12], m[s[ 0]], m[s[ 1]])
+            VG(v[1], v[5], v[ 9], v[13], m[s[ 2]], m[s[ 3]])
+            VG(v[2], v[6], v[10], v[14], m[s[ 4]], m[s[ 5]])
+            VG(v[3], v[7], v[11], v[15], m[s[ 6]], m[s[ 7]])
+            VG(v[0], v[5], v[10], v[15], m[s[ 8]], m[s[ 9]])
+            VG(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]])
+            VG(v[2], v[7], v[ 8], v[13], m[s[12]], m[s[13]])
+            VG(v[3], v[4], v[ 9], v[14], m[s[14]], m[s[15]])
+        }
+        for (i = 0; i < 8; i++)
+            h[i] = v[i] ^ v[i + 8];
+    }
+    memcpy(t, h, sizeof(h));
+    for (l = 0; l < LANES; l++)
+        for (i = 0; i < 8; i++)
+            wr_le32(out + l * 32 + i * 4, t[i][l]);
+}
+
+#undef V
+#undef VG
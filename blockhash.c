@@ -0,0 +1,134 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parhash.h"
+#include "throttle.h"
+#include "blockhash.h"
+
+typedef struct Blockhash {
+    Parhash *ph;
+    Throttle *throttle;
+    int fd;
+    uint64_t size;
+    size_t block_size;
+    uint64_t nb_blocks;
+    unsigned nb_hashes;
+    Parhash_info *hi;
+    uint64_t next;
+    int error;
+} Blockhash;
+
+static int
+blockhash_read(Blockhash *bh, uint8_t *buf, uint64_t pos, size_t size)
+{
+    size_t done = 0;
+    ssize_t r;
+
+    throttle_read(bh->throttle, size);
+    while (done < size) {
+        r = pread(bh->fd, buf + done, size - done, pos + done);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0) {
+            /* the file was truncated while we read it */
+            errno = EIO;
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+static void *
+blockhash_thread(void *bh_v)
+{
+    Blockhash *bh = bh_v;
+    const uint8_t *data;
+    Parhash_info *hi;
+    uint8_t *buf;
+    uint64_t idx, pos;
+    size_t size;
+
+    buf = malloc(bh->block_size);
+    if (buf == NULL) {
+        __atomic_store_n(&bh->error, ENOMEM, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    data = buf;
+    while (__atomic_load_n(&bh->error, __ATOMIC_RELAXED) == 0) {
+        idx = __atomic_fetch_add(&bh->next, 1, __ATOMIC_RELAXED);
+        if (idx >= bh->nb_blocks)
+            break;
+        pos = idx * bh->block_size;
+        size = bh->size - pos < bh->block_size ? bh->size - pos :
+            bh->block_size;
+        if (blockhash_read(bh, buf, pos, size) < 0) {
+            __atomic_store_n(&bh->error, errno, __ATOMIC_RELAXED);
+            break;
+        }
+        hi = bh->hi + idx * bh->nb_hashes;
+        parhash_hash_buffers(bh->ph, 1, &data, &size, &hi);
+    }
+    free(buf);
+    return NULL;
+}
+
+int
+blockhash_file(Parhash *ph, int fd, uint64_t size, size_t block_size,
+    unsigned nb_threads, Throttle *throttle, Parhash_info *hi)
+{
+    Blockhash bh = {
+        .ph         = ph,
+        .throttle   = throttle,
+        .fd         = fd,
+        .size       = size,
+        .block_size = block_size,
+        .nb_blocks  = size == 0 ? 1 : (size + block_size - 1) / block_size,
+        .hi         = hi,
+    };
+    pthread_t *thread;
+    unsigned i, nb_started;
+
+    while (parhash_get_info(ph, bh.nb_hashes) != NULL)
+        bh.nb_hashes++;
+    if (nb_threads > bh.nb_blocks)
+        nb_threads = bh.nb_blocks;
+    thread = malloc(nb_threads * sizeof(*thread));
+    if (thread == NULL)
+        nb_threads = 1;
+    /* the calling thread is one of the workers */
+    for (nb_started = 0; nb_started + 1 < nb_threads; nb_started++)
+        if (pthread_create(&thread[nb_started], NULL, blockhash_thread,
+            &bh) != 0)
+            break;
+    blockhash_thread(&bh);
+    for (i = 0; i < nb_started; i++)
+        pthread_join(thread[i], NULL);
+    free(thread);
+    if (bh.error != 0) {
+        errno = bh.error;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * Hash the fixed-size blocks of a file independently on a pool of
+ * threads reading with pread().
+ */
+
+/**
+ * Hash the blocks of block_size bytes of fd, the last one
+ * possibly shorter, using nb_threads threads; an empty file has a single
+ * empty block. The reads go through throttle, which can be NULL.
+ * hi holds one array of one entry per hash for each block, in the order
+ * of parhash_get_info(); entries with disabled set are skipped.
+ * Returns 0, or -1 with errno set if the file could not be read entirely.
+ */
+int blockhash_file(Parhash *ph, int fd, uint64_t size, size_t block_size,
+    unsigned nb_threads, Throttle *throttle, Parhash_info *hi);
@@ -15,6 +15,7 @@
 #define _DEFAULT_SOURCE /* for db.h */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -128,17 +129,16 @@ stat_cache_open(Stat_cache *cache)
 }
 
 static void
-key_from_filename(DBT *dbt, const char *path, const struct stat *st,
-    const char *hash)
+key_printf(DBT *dbt, const char *fmt, ...)
 {
+    va_list va;
     unsigned i, l, bufsize = 0;
     char *buf = NULL;
 
     for (i = 0; i < 2; i++) {
-        l = snprintf(buf, bufsize, "%s%c%ju:%ju:%ju.%09u:%s",
-            path, 0, (uintmax_t)st->st_size, (uintmax_t)st->st_ino,
-            (uintmax_t)st->st_ctim.tv_sec, (unsigned)st->st_ctim.tv_nsec,
-            hash);
+        va_start(va, fmt);
+        l = vsnprintf(buf, bufsize, fmt, va);
+        va_end(va);
         if (l <= 0) {
             perror("snprintf");
             exit(1);
@@ -156,22 +156,39 @@ key_from_filename(DBT *dbt, const char *path, const struct stat *st,
     dbt->size = bufsize - 1;
 }
 
-int
-stat_cache_get(Stat_cache *cache, const char *path,
-    const struct stat *st, const char *hash,
-    uint8_t *data, size_t size)
+static void
+key_from_filename(DBT *dbt, const char *path, const struct stat *st,
+    const char *hash)
+{
+    key_printf(dbt, "%s%c%ju:%ju:%ju.%09u:%s",
+        path, 0, (uintmax_t)st->st_size, (uintmax_t)st->st_ino,
+        (uintmax_t)st->st_ctim.tv_sec, (unsigned)st->st_ctim.tv_nsec,
+        hash);
+}
+
+/*
+ * Checkpoints must survive the file growing: only the inode is part of
+ * the key; the leading '+' keeps them apart from the hashes.
+ */
+static void
+key_checkpoint(DBT *dbt, const char *path, const struct stat *st,
+    const char *hash)
+{
+    key_printf(dbt, "%s%c+%ju:%s", path, 0, (uintmax_t)st->st_ino, hash);
+}
+
+static int
+stat_cache_get_key(Stat_cache *cache, DBT *tkey, const char *path,
+    const char *hash, uint8_t *data, size_t size)
 {
-    DBT tkey = { 0 }, tdata = { 0 };
+    DBT tdata = { 0 };
     int ret;
 
-    if (stat_cache_open(cache) < 0)
-        return -1;
-    key_from_filename(&tkey, path, st, hash);
     tdata.data = data;
     tdata.ulen = size;
     tdata.flags = DB_DBT_USERMEM;
-    ret = cache->db->get(cache->db, NULL, &tkey, &tdata, 0);
-    free(tkey.data);
+    ret = cache->db->get(cache->db, NULL, tkey, &tdata, 0);
+    free(tkey->data);
     if (ret != 0) {
         if (ret == DB_NOTFOUND)
             return 0;
@@ -185,24 +202,70 @@ stat_cache_get(Stat_cache *cache, const char *path,
     return 1;
 }
 
-int stat_cache_set(Stat_cache *cache, const char *path,
-    const struct stat *st, const char *hash,
-    uint8_t *data, size_t size)
+static int
+stat_cache_set_key(Stat_cache *cache, DBT *tkey, uint8_t *data, size_t size)
 {
-    DBT tkey = { 0 }, tdata = { 0 };
+    DBT tdata = { 0 };
     int ret;
 
-    if (stat_cache_open(cache) < 0)
-        return -1;
-    key_from_filename(&tkey, path, st, hash);
     tdata.data = data;
     tdata.size = size;
-    ret = cache->db->put(cache->db, NULL, &tkey, &tdata, 0);
+    ret = cache->db->put(cache->db, NULL, tkey, &tdata, 0);
     if (ret != 0) {
         fprintf(stderr, "Failed to insert in cache: %s\n", db_strerror(ret));
         exit(1);
     }
-    free(tkey.data);
+    free(tkey->data);
     return 0;
 }
 
+int
+stat_cache_get(Stat_cache *cache, const char *path,
+    const struct stat *st, const char *hash,
+    uint8_t *data, size_t size)
+{
+    DBT tkey = { 0 };
+
+    if (stat_cache_open(cache) < 0)
+        return -1;
+    key_from_filename(&tkey, path, st, hash);
+    return stat_cache_get_key(cache, &tkey, path, hash, data, size);
+}
+
+int stat_cache_set(Stat_cache *cache, const char *path,
+    const struct stat *st, const char *hash,
+    uint8_t *data, size_t size)
+{
+    DBT tkey = { 0 };
+
+    if (stat_cache_open(cache) < 0)
+        return -1;
+    key_from_filename(&tkey, path, st, hash);
+    return stat_cache_set_key(cache, &tkey, data, size);
+}
+
+int
+stat_cache_get_checkpoint(Stat_cache *cache, const char *path,
+    const struct stat *st, const char *hash,
+    uint8_t *data, size_t size)
+{
+    DBT tkey = { 0 };
+
+    if (stat_cache_open(cache) < 0)
+        return -1;
+    key_checkpoint(&tkey, path, st, hash);
+    return stat_cache_get_key(cache, &tkey, path, hash, data, size);
+}
+
+int
+stat_cache_set_checkpoint(Stat_cache *cache, const char *path,
+    const struct stat *st, const char *hash,
+    uint8_t *data, size_t size)
+{
+    DBT tkey = { 0 };
+
+    if (stat_cache_open(cache) < 0)
+        return -1;
+    key_checkpoint(&tkey, path, st, hash);
+    return stat_cache_set_key(cache, &tkey, data, size);
+}
@@ -25,3 +25,15 @@ int stat_cache_get(Stat_cache *cache, const char *path,
 int stat_cache_set(Stat_cache *cache, const char *path,
     const struct stat *st, const char *hash,
     uint8_t *data, size_t size);
+
+/**
+ * Checkpoints are looked up with only the path and inode of the file,
+ * so they are still found when the file has changed.
+ */
+int stat_cache_get_checkpoint(Stat_cache *cache, const char *path,
+    const struct stat *st, const char *hash,
+    uint8_t *data, size_t size);
+
+int stat_cache_set_checkpoint(Stat_cache *cache, const char *path,
+    const struct stat *st, const char *hash,
+    uint8_t *data, size_t size);
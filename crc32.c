@@ -0,0 +1,243 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2016 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "crc32.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_CLMUL 1
+# include <immintrin.h>
+#endif
+
+static uint32_t crc32_table[8][256];
+
+/* x^(2^k) modulo the polynomial, bit-reflected; the period is 32 */
+static uint32_t crc32_x2n[32];
+
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static uint32_t (*crc32_update_impl)(uint32_t, const uint8_t *, size_t);
+
+/*
+ * Slicing-by-8: one table lookup per input byte like the classic
+ * algorithm, but the eight lookups of a word are independent.
+ */
+static uint32_t
+crc32_update_generic(uint32_t crc, const uint8_t *buf, size_t size)
+{
+    const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32_table;
+
+    while (size >= 8) {
+        crc ^= (uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+            (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+        crc = t[7][crc & 0xFF] ^ t[6][(crc >> 8) & 0xFF] ^
+            t[5][(crc >> 16) & 0xFF] ^ t[4][crc >> 24] ^
+            t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]];
+        buf += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = (crc >> 8) ^ t[0][(uint8_t)(crc ^ *(buf++))];
+    return crc;
+}
+
+#ifdef HAVE_CLMUL
+
+/*
+ * Folding with carry-less multiplication, from Intel's white paper "Fast
+ * CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction";
+ * the constants are for the bit-reflected 0x04C11DB7 polynomial.
+ * Requires size >= 64 and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc32_fold_clmul(uint32_t crc, const uint8_t *buf, size_t size)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    size -= 64;
+
+    /* fold four lanes by 512 bits */
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        size -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* fold the remaining 128-bit blocks */
+    while (size >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        size -= 16;
+    }
+
+    /* reduce 128 bits to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+crc32_update_clmul(uint32_t crc, const uint8_t *buf, size_t size)
+{
+    size_t n;
+
+    if (size >= 64) {
+        n = size & ~(size_t)15;
+        crc = crc32_fold_clmul(crc, buf, n);
+        buf += n;
+        size -= n;
+    }
+    return crc32_update_generic(crc, buf, size);
+}
+
+#endif
+
+/*
+ * Product of polynomials modulo the CRC polynomial, bit-reflected:
+ * 0x80000000 is 1.
+ */
+static uint32_t
+crc32_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t m = 0x80000000, p = 0;
+
+    while (m != 0) {
+        if ((a & m))
+            p ^= b;
+        m >>= 1;
+        b = (b >> 1) ^ ((b & 1) ? 0xEDB88320 : 0);
+    }
+    return p;
+}
+
+static void
+crc32_setup_once(void)
+{
+    unsigned i, j, c;
+    const unsigned base = 0xEDB88320;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = (c >> 1) ^ ((c & 1) ? base : 0);
+        crc32_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crc32_table[j][i] = (crc32_table[j - 1][i] >> 8) ^
+                crc32_table[0][crc32_table[j - 1][i] & 0xFF];
+    crc32_x2n[0] = 0x40000000;
+    for (i = 1; i < 32; i++)
+        crc32_x2n[i] = crc32_multiply(crc32_x2n[i - 1], crc32_x2n[i - 1]);
+
+    crc32_update_impl = crc32_update_generic;
+    if (getenv("MULTIHASH_GENERIC") != NULL)
+        return;
+#ifdef HAVE_CLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        crc32_update_impl = crc32_update_clmul;
+#endif
+}
+
+void
+crc32_setup(void)
+{
+    pthread_once(&crc32_once, crc32_setup_once);
+}
+
+uint32_t
+crc32_update(uint32_t crc, const uint8_t *buf, size_t size)
+{
+    return crc32_update_impl(crc, buf, size);
+}
+
+/*
+ * Without the inversions, a zero byte only multiplies the CRC by x^8:
+ * size zero bytes multiply it by x^(8 * size), from the bits of size.
+ */
+uint32_t
+crc32_zeros(uint32_t crc, uint64_t size)
+{
+    unsigned k = 3;
+
+    for (; size != 0; size >>= 1, k++)
+        if ((size & 1))
+            crc = crc32_multiply(crc32_x2n[k & 31], crc);
+    return crc;
+}
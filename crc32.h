@@ -0,0 +1,30 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2016 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/**
+ * Select the best implementation for the running CPU;
+ * must be called before crc32_update(), can be called several times.
+ */
+void crc32_setup(void);
+
+/**
+ * Update a CRC-32 (IEEE 802.3, reflected) with data;
+ * the CRC is not inverted, start with 0xFFFFFFFF and invert at the end.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t size);
+
+/**
+ * Update a CRC-32 with size zero bytes, in logarithmic time.
+ */
+uint32_t crc32_zeros(uint32_t crc, uint64_t size);
@@ -0,0 +1,139 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "xxh3.h"
+#include "extents.h"
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+/* extents read at once for a fingerprint */
+#define FINGERPRINT_EXTENTS 128
+
+int
+extents_first_physical(int fd, uint64_t *physical)
+{
+    struct {
+        struct fiemap fm;
+        struct fiemap_extent fe[1];
+    } map;
+
+    memset(&map, 0, sizeof(map));
+    map.fm.fm_start = 0;
+    map.fm.fm_length = FIEMAP_MAX_OFFSET;
+    map.fm.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &map.fm) < 0)
+        return -1;
+    /* inline data and delayed allocation have no meaningful address */
+    if (map.fm.fm_mapped_extents == 0 ||
+        (map.fe[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN |
+            FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED))) {
+        errno = ENODATA;
+        return -1;
+    }
+    *physical = map.fe[0].fe_physical;
+    return 0;
+}
+
+static void
+put_u64(uint8_t *p, uint64_t v)
+{
+    unsigned i;
+
+    for (i = 0; i < 8; i++)
+        p[i] = v >> (i * 8);
+}
+
+int
+extents_fingerprint(int fd, uint64_t size, uint8_t *out)
+{
+    struct {
+        struct fiemap fm;
+        struct fiemap_extent fe[FINGERPRINT_EXTENTS];
+    } map;
+    const unsigned bad_flags = FIEMAP_EXTENT_UNKNOWN |
+        FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+        FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED |
+        FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL |
+        FIEMAP_EXTENT_UNWRITTEN;
+    struct fiemap_extent *fe;
+    uint8_t buf[24];
+    Xxh3_state xxh;
+    uint64_t start = 0;
+    unsigned i, flags = FIEMAP_FLAG_SYNC;
+
+    xxh3_setup();
+    xxh3_init(&xxh);
+    put_u64(buf, size);
+    xxh3_update(&xxh, buf, 8);
+    while (1) {
+        memset(&map.fm, 0, sizeof(map.fm));
+        map.fm.fm_start = start;
+        map.fm.fm_length = FIEMAP_MAX_OFFSET - start;
+        map.fm.fm_flags = flags;
+        map.fm.fm_extent_count = FINGERPRINT_EXTENTS;
+        if (ioctl(fd, FS_IOC_FIEMAP, &map.fm) < 0)
+            return -1;
+        /* only sync once */
+        flags = 0;
+        /* a file without extents shares nothing */
+        if (map.fm.fm_mapped_extents == 0)
+            return 0;
+        for (i = 0; i < map.fm.fm_mapped_extents; i++) {
+            fe = &map.fe[i];
+            if ((fe->fe_flags & bad_flags) ||
+                !(fe->fe_flags & FIEMAP_EXTENT_SHARED))
+                return 0;
+            put_u64(buf, fe->fe_logical);
+            put_u64(buf + 8, fe->fe_physical);
+            put_u64(buf + 16, fe->fe_length);
+            xxh3_update(&xxh, buf, sizeof(buf));
+            if ((fe->fe_flags & FIEMAP_EXTENT_LAST)) {
+                xxh3_final(&xxh, out);
+                return 1;
+            }
+        }
+        start = fe->fe_logical + fe->fe_length;
+    }
+}
+
+#else
+
+int
+extents_first_physical(int fd, uint64_t *physical)
+{
+    (void)fd;
+    (void)physical;
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+extents_fingerprint(int fd, uint64_t size, uint8_t *out)
+{
+    (void)fd;
+    (void)size;
+    (void)out;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * Physical layout of files on their device, from the FIEMAP ioctl.
+ */
+
+/**
+ * Get the physical offset in bytes of the start of the first extent of
+ * fd on its device.
+ * Returns -1 with errno set if the file has no extent or the file system
+ * does not tell, without printing anything.
+ */
+int extents_first_physical(int fd, uint64_t *physical);
+
+#define EXTENTS_FINGERPRINT_SIZE 16
+
+/**
+ * Fingerprint the extent map of fd: the logical and physical offsets and
+ * lengths of its extents, and its size, in
+ * EXTENTS_FINGERPRINT_SIZE bytes. Dirty data is written first, so
+ * that the map matches the contents.
+ * Returns 1 if all the extents are shared with other files and have a
+ * plain physical address, 0 if not, or -1 with errno set if the file
+ * system does not tell, without printing anything.
+ */
+int extents_fingerprint(int fd, uint64_t size, uint8_t *out);
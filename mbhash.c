@@ -0,0 +1,227 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mbhash.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# define HAVE_X86_VECTORS 1
+#endif
+
+typedef struct Mbhash_impl {
+    enum Mbhash_function fn;
+    uint8_t big_endian;
+    uint8_t nb_words;
+    uint8_t digest_words;
+    uint32_t iv[8];
+} Mbhash_impl;
+
+typedef struct Mbhash_lane {
+    Mbhash_msg *msg;
+    const uint8_t *data;
+    size_t blocks;
+    unsigned tail_blocks;
+    unsigned tail_pos;
+    uint8_t tail[128];
+} Mbhash_lane;
+
+static const Mbhash_impl mbhash_impl[MBHASH_NB] = {
+    [MBHASH_MD5   ] = { MBHASH_MD5,    0, 4, 4,
+        { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 } },
+    [MBHASH_SHA1  ] = { MBHASH_SHA1,   1, 5, 5,
+        { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 } },
+    [MBHASH_SHA256] = { MBHASH_SHA256, 1, 8, 8,
+        { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+          0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 } },
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint8_t zero_block[64];
+
+static pthread_once_t mbhash_once = PTHREAD_ONCE_INIT;
+
+static void (*mbhash_run_impl)(const Mbhash_impl *, Mbhash_msg *, unsigned);
+
+static unsigned mbhash_nb_lanes[MBHASH_NB];
+
+static inline uint32_t
+rd_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+        (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t
+rd_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+        (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline void
+wr_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void
+wr_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/*
+ * The full blocks are read from the message itself, the last partial
+ * block and the padding are built in the lane.
+ */
+static void
+lane_load(Mbhash_lane *lane, Mbhash_msg *msg, int big_endian)
+{
+    size_t rem = msg->size % 64;
+    uint64_t bits = (uint64_t)msg->size * 8;
+    uint8_t *len;
+    unsigned i;
+
+    lane->msg = msg;
+    lane->data = msg->data;
+    lane->blocks = msg->size / 64;
+    lane->tail_blocks = rem < 56 ? 1 : 2;
+    lane->tail_pos = 0;
+    memcpy(lane->tail, msg->data + lane->blocks * 64, rem);
+    lane->tail[rem] = 0x80;
+    memset(lane->tail + rem + 1, 0, lane->tail_blocks * 64 - rem - 1);
+    len = lane->tail + lane->tail_blocks * 64 - 8;
+    for (i = 0; i < 8; i++)
+        len[big_endian ? 7 - i : i] = bits >> (i * 8);
+}
+
+static inline const uint8_t *
+lane_block(const Mbhash_lane *lane)
+{
+    return lane->blocks ? lane->data : lane->tail + lane->tail_pos * 64;
+}
+
+/* returns 1 when the message is finished */
+static inline int
+lane_advance(Mbhash_lane *lane)
+{
+    if (lane->blocks) {
+        lane->data += 64;
+        lane->blocks--;
+        return 0;
+    }
+    lane->tail_pos++;
+    return lane->tail_pos == lane->tail_blocks;
+}
+
+#define LANES 4
+#define FN(name) name ## _x4
+#define TARGET
+#include "mbhash_template.c"
+#undef LANES
+#undef FN
+#undef TARGET
+
+#ifdef HAVE_X86_VECTORS
+
+#define LANES 8
+#define FN(name) name ## _x8
+#define TARGET __attribute__((target("avx2")))
+#include "mbhash_template.c"
+#undef LANES
+#undef FN
+#undef TARGET
+
+#define LANES 16
+#define FN(name) name ## _x16
+#define TARGET __attribute__((target("avx512f")))
+#include "mbhash_template.c"
+#undef LANES
+#undef FN
+#undef TARGET
+
+#endif
+
+static void
+mbhash_setup_once(void)
+{
+    unsigned lanes = 4;
+
+    mbhash_run_impl = run_x4;
+#ifdef HAVE_X86_VECTORS
+    if (getenv("MULTIHASH_GENERIC") == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            mbhash_run_impl = run_x16;
+            lanes = 16;
+        } else if (__builtin_cpu_supports("avx2")) {
+            mbhash_run_impl = run_x8;
+            lanes = 8;
+        }
+    }
+#endif
+    /*
+     * MD5 has no hardware support and always wins; the scalar SHA code
+     * can use the SHA extensions and is only beaten by wide vectors.
+     */
+    mbhash_nb_lanes[MBHASH_MD5] = lanes;
+    mbhash_nb_lanes[MBHASH_SHA1] = lanes >= 8 ? lanes : 0;
+    mbhash_nb_lanes[MBHASH_SHA256] = lanes >= 16 ? lanes : 0;
+}
+
+void
+mbhash_setup(void)
+{
+    pthread_once(&mbhash_once, mbhash_setup_once);
+}
+
+unsigned
+mbhash_lanes(enum Mbhash_function fn)
+{
+    return mbhash_nb_lanes[fn];
+}
+
+void
+mbhash_run(enum Mbhash_function fn, Mbhash_msg *msg, unsigned nb)
+{
+    mbhash_run_impl(&mbhash_impl[fn], msg, nb);
+}
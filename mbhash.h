@@ -0,0 +1,48 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * Multi-buffer hashing: several independent messages are hashed at once,
+ * one per SIMD lane.
+ */
+
+enum Mbhash_function {
+    MBHASH_MD5,
+    MBHASH_SHA1,
+    MBHASH_SHA256,
+    MBHASH_NB,
+};
+
+typedef struct Mbhash_msg {
+    const uint8_t *data;
+    size_t size;
+    uint8_t *out;
+} Mbhash_msg;
+
+/**
+ * Select the best implementation for the running CPU;
+ * must be called before the other functions, can be called several times.
+ */
+void mbhash_setup(void);
+
+/**
+ * Number of messages hashed at once, 0 if multi-buffer hashing is not
+ * worth it for that function on this CPU.
+ */
+unsigned mbhash_lanes(enum Mbhash_function fn);
+
+/**
+ * Hash complete messages; the digests are stored in msg[i].out.
+ */
+void mbhash_run(enum Mbhash_function fn, Mbhash_msg *msg, unsigned nb);
@@ -0,0 +1,257 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * Included by mbhash.c once per vector width, with LANES, FN() and
+ * TARGET defined.
+ */
+
+typedef uint32_t FN(vec) __attribute__((vector_size(LANES * 4)));
+#define V FN(vec)
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+TARGET static void
+FN(load)(V *w, const uint8_t *const *p, int big_endian)
+{
+    uint32_t t[16][LANES] __attribute__((aligned(64)));
+    unsigned i, l;
+
+    for (l = 0; l < LANES; l++)
+        for (i = 0; i < 16; i++)
+            t[i][l] = big_endian ? rd_be32(p[l] + i * 4) :
+                rd_le32(p[l] + i * 4);
+    memcpy(w, t, sizeof(t));
+}
+
+#define MD5_STEP(f, a, b, c, d, x, t, s) \
+    a += f(b, c, d) + x + t; \
+    a = ROTL(a, s) + b;
+#define MD5_F(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define MD5_G(b, c, d) ((c) ^ ((d) & ((b) ^ (c))))
+#define MD5_H(b, c, d) ((b) ^ (c) ^ (d))
+#define MD5_I(b, c, d) ((c) ^ ((b) | ~(d)))
+
+TARGET static void
+FN(md5_block)(V *st, const uint8_t *const *p)
+{
+    V x[16], a = st[0], b = st[1], c = st[2], d = st[3];
+
+    FN(load)(x, p, 0);
+    MD5_STEP(MD5_F, a, b, c, d, x[ 0], 0xd76aa478,  7)
+    MD5_STEP(MD5_F, d, a, b, c, x[ 1], 0xe8c7b756, 12)
+    MD5_STEP(MD5_F, c, d, a, b, x[ 2], 0x242070db, 17)
+    MD5_STEP(MD5_F, b, c, d, a, x[ 3], 0xc1bdceee, 22)
+    MD5_STEP(MD5_F, a, b, c, d, x[ 4], 0xf57c0faf,  7)
+    MD5_STEP(MD5_F, d, a, b, c, x[ 5], 0x4787c62a, 12)
+    MD5_STEP(MD5_F, c, d, a, b, x[ 6], 0xa8304613, 17)
+    MD5_STEP(MD5_F, b, c, d, a, x[ 7], 0xfd469501, 22)
+    MD5_STEP(MD5_F, a, b, c, d, x[ 8], 0x698098d8,  7)
+    MD5_STEP(MD5_F, d, a, b, c, x[ 9], 0x8b44f7af, 12)
+    MD5_STEP(MD5_F, c, d, a, b, x[10], 0xffff5bb1, 17)
+    MD5_STEP(MD5_F, b, c, d, a, x[11], 0x895cd7be, 22)
+    MD5_STEP(MD5_F, a, b, c, d, x[12], 0x6b901122,  7)
+    MD5_STEP(MD5_F, d, a, b, c, x[13], 0xfd987193, 12)
+    MD5_STEP(MD5_F, c, d, a, b, x[14], 0xa679438e, 17)
+    MD5_STEP(MD5_F, b, c, d, a, x[15], 0x49b40821, 22)
+    MD5_STEP(MD5_G, a, b, c, d, x[ 1], 0xf61e2562,  5)
+    MD5_STEP(MD5_G, d, a, b, c, x[ 6], 0xc040b340,  9)
+    MD5_STEP(MD5_G, c, d, a, b, x[11], 0x265e5a51, 14)
+    MD5_STEP(MD5_G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20)
+    MD5_STEP(MD5_G, a, b, c, d, x[ 5], 0xd62f105d,  5)
+    MD5_STEP(MD5_G, d, a, b, c, x[10], 0x02441453,  9)
+    MD5_STEP(MD5_G, c, d, a, b, x[15], 0xd8a1e681, 14)
+    MD5_STEP(MD5_G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20)
+    MD5_STEP(MD5_G, a, b, c, d, x[ 9], 0x21e1cde6,  5)
+    MD5_STEP(MD5_G, d, a, b, c, x[14], 0xc33707d6,  9)
+    MD5_STEP(MD5_G, c, d, a, b, x[ 3], 0xf4d50d87, 14)
+    MD5_STEP(MD5_G, b, c, d, a, x[ 8], 0x455a14ed, 20)
+    MD5_STEP(MD5_G, a, b, c, d, x[13], 0xa9e3e905,  5)
+    MD5_STEP(MD5_G, d, a, b, c, x[ 2], 0xfcefa3f8,  9)
+    MD5_STEP(MD5_G, c, d, a, b, x[ 7], 0x676f02d9, 14)
+    MD5_STEP(MD5_G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+    MD5_STEP(MD5_H, a, b, c, d, x[ 5], 0xfffa3942,  4)
+    MD5_STEP(MD5_H, d, a, b, c, x[ 8], 0x8771f681, 11)
+    MD5_STEP(MD5_H, c, d, a, b, x[11], 0x6d9d6122, 16)
+    MD5_STEP(MD5_H, b, c, d, a, x[14], 0xfde5380c, 23)
+    MD5_STEP(MD5_H, a, b, c, d, x[ 1], 0xa4beea44,  4)
+    MD5_STEP(MD5_H, d, a, b, c, x[ 4], 0x4bdecfa9, 11)
+    MD5_STEP(MD5_H, c, d, a, b, x[ 7], 0xf6bb4b60, 16)
+    MD5_STEP(MD5_H, b, c, d, a, x[10], 0xbebfbc70, 23)
+    MD5_STEP(MD5_H, a, b, c, d, x[13], 0x289b7ec6,  4)
+    MD5_STEP(MD5_H, d, a, b, c, x[ 0], 0xeaa127fa, 11)
+    MD5_STEP(MD5_H, c, d, a, b, x[ 3], 0xd4ef3085, 16)
+    MD5_STEP(MD5_H, b, c, d, a, x[ 6], 0x04881d05, 23)
+    MD5_STEP(MD5_H, a, b, c, d, x[ 9], 0xd9d4d039,  4)
+    MD5_STEP(MD5_H, d, a, b, c, x[12], 0xe6db99e5, 11)
+    MD5_STEP(MD5_H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+    MD5_STEP(MD5_H, b, c, d, a, x[ 2], 0xc4ac5665, 23)
+    MD5_STEP(MD5_I, a, b, c, d, x[ 0], 0xf4292244,  6)
+    MD5_STEP(MD5_I, d, a, b, c, x[ 7], 0x432aff97, 10)
+    MD5_STEP(MD5_I, c, d, a, b, x[14], 0xab9423a7, 15)
+    MD5_STEP(MD5_I, b, c, d, a, x[ 5], 0xfc93a039, 21)
+    MD5_STEP(MD5_I, a, b, c, d, x[12], 0x655b59c3,  6)
+    MD5_STEP(MD5_I, d, a, b, c, x[ 3], 0x8f0ccc92, 10)
+    MD5_STEP(MD5_I, c, d, a, b, x[10], 0xffeff47d, 15)
+    MD5_STEP(MD5_I, b, c, d, a, x[ 1], 0x85845dd1, 21)
+    MD5_STEP(MD5_I, a, b, c, d, x[ 8], 0x6fa87e4f,  6)
+    MD5_STEP(MD5_I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+    MD5_STEP(MD5_I, c, d, a, b, x[ 6], 0xa3014314, 15)
+    MD5_STEP(MD5_I, b, c, d, a, x[13], 0x4e0811a1, 21)
+    MD5_STEP(MD5_I, a, b, c, d, x[ 4], 0xf7537e82,  6)
+    MD5_STEP(MD5_I, d, a, b, c, x[11], 0xbd3af235, 10)
+    MD5_STEP(MD5_I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15)
+    MD5_STEP(MD5_I, b, c, d, a, x[ 9], 0xeb86d391, 21)
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+}
+
+TARGET static void
+FN(sha1_block)(V *st, const uint8_t *const *p)
+{
+    V w[16], a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f, t;
+    unsigned i;
+
+    FN(load)(w, p, 1);
+#pragma GCC unroll 80
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            t = w[(i - 3) & 15] ^ w[(i - 8) & 15] ^ w[(i - 14) & 15] ^
+                w[i & 15];
+            w[i & 15] = ROTL(t, 1);
+        }
+        if (i < 20)
+            f = (d ^ (b & (c ^ d))) + 0x5A827999;
+        else if (i < 40)
+            f = (b ^ c ^ d) + 0x6ED9EBA1;
+        else if (i < 60)
+            f = ((b & c) | (d & (b | c))) + 0x8F1BBCDC;
+        else
+            f = (b ^ c ^ d) + 0xCA62C1D6;
+        t = ROTL(a, 5) + f + e + w[i & 15];
+        e = d;
+        d = c;
+        c = ROTL(b, 30);
+        b = a;
+        a = t;
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+    st[4] += e;
+}
+
+TARGET static void
+FN(sha256_block)(V *st, const uint8_t *const *p)
+{
+    V w[16], a = st[0], b = st[1], c = st[2], d = st[3];
+    V e = st[4], f = st[5], g = st[6], h = st[7], t1, t2, s0, s1;
+    unsigned i;
+
+    FN(load)(w, p, 1);
+#pragma GCC unroll 64
+    for (i = 0; i < 64; i++) {
+        if (i >= 16) {
+            s0 = w[(i - 15) & 15];
+            s0 = ROTR(s0, 7) ^ ROTR(s0, 18) ^ (s0 >> 3);
+            s1 = w[(i - 2) & 15];
+            s1 = ROTR(s1, 17) ^ ROTR(s1, 19) ^ (s1 >> 10);
+            w[i & 15] += s0 + w[(i - 7) & 15] + s1;
+        }
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+            (g ^ (e & (f ^ g))) + sha256_k[i] + w[i & 15];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+            ((a & b) | (c & (a | b)));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+    st[4] += e;
+    st[5] += f;
+    st[6] += g;
+    st[7] += h;
+}
+
+/*
+ * Keep all lanes busy: as soon as a message is finished, the next one is
+ * loaded in its lane; idle lanes hash a dummy block.
+ */
+TARGET static void
+FN(run)(const Mbhash_impl *impl, Mbhash_msg *msg, unsigned nb)
+{
+    Mbhash_lane lane[LANES];
+    const uint8_t *p[LANES];
+    V st[8];
+    unsigned i, j, next = 0, active;
+
+    for (i = 0; i < LANES; i++)
+        lane[i].msg = NULL;
+    while (1) {
+        active = 0;
+        for (i = 0; i < LANES; i++) {
+            if (lane[i].msg == NULL && next < nb) {
+                lane_load(&lane[i], &msg[next++], impl->big_endian);
+                for (j = 0; j < impl->nb_words; j++)
+                    st[j][i] = impl->iv[j];
+            }
+            if (lane[i].msg != NULL) {
+                p[i] = lane_block(&lane[i]);
+                active++;
+            } else {
+                p[i] = zero_block;
+            }
+        }
+        if (active == 0)
+            break;
+        switch (impl->fn) {
+        case MBHASH_MD5:    FN(md5_block)(st, p);    break;
+        case MBHASH_SHA1:   FN(sha1_block)(st, p);   break;
+        case MBHASH_SHA256: FN(sha256_block)(st, p); break;
+        default: abort();
+        }
+        for (i = 0; i < LANES; i++) {
+            if (lane[i].msg == NULL || !lane_advance(&lane[i]))
+                continue;
+            for (j = 0; j < impl->digest_words; j++) {
+                if (impl->big_endian)
+                    wr_be32(lane[i].msg->out + j * 4, st[j][i]);
+                else
+                    wr_le32(lane[i].msg->out + j * 4, st[j][i]);
+            }
+            lane[i].msg = NULL;
+        }
+    }
+}
+
+#undef V
+#undef ROTL
+#undef ROTR
+#undef MD5_STEP
+#undef MD5_F
+#undef MD5_G
+#undef MD5_H
+#undef MD5_I
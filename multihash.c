@@ -12,6 +12,7 @@
  * See the GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE /* for O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -20,71 +21,541 @@
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "cache.h"
 #include "formatter.h"
 #include "parhash.h"
 #include "treewalk.h"
 #include "archive.h"
+#include "scheduler.h"
+#include "xxh3.h"
+#include "uring.h"
+#include "extents.h"
+#include "throttle.h"
+#include "blockhash.h"
 
 #define MIN_READ 65536
 #define MAX_READ (1024 * 1024)
 
+/* requested size of the pipes read, to allow reads of MAX_READ */
+#define PIPE_SIZE MAX_READ
+/* Alignment of offsets, sizes and buffers for O_DIRECT */
+#define DIRECT_ALIGN 4096
+/* In recursive mode, the start of that many files waiting to be hashed
+   is read in advance */
+#define LOOKAHEAD_FILES 16
+#define LOOKAHEAD_SIZE (4 * 1024 * 1024)
+/* With -P, files of the walk are sorted by physical position by groups
+   of that many; their descriptors are kept open meanwhile */
+#define PHYSICAL_WINDOW 256
+/* Cached files are hashed from a mapping if that proportion (/ 256) is
+   in memory */
+#define MAPPED_RESIDENT 230
+/* Holes of sparse files from that size are hashed as runs of zeros
+   instead of being read */
+#define SPARSE_MIN_HOLE (1024 * 1024)
+/* Reads in flight with io_uring and size of each */
+#define URING_DEPTH 8
+#define URING_READ (256 * 1024)
+
+#define WINDOW_PER_JOB 16
+#define WINDOW_MAX 512
+/* With -J, scheduler queues for distinct devices; more devices share */
+#define DEVICE_QUEUES 64
+
+/* Files up to that size are read at once and hashed in the worker */
+#define SMALL_FILE_SIZE (256 * 1024)
+/* Small files are read together to be hashed at once */
+#define BATCH_BUF_SIZE (2 * 1024 * 1024)
+/* With -A, the hash states of files from that size are kept to hash only
+   what is appended to them */
+#define CHECKPOINT_MIN_SIZE (16 * 1024 * 1024)
+/* Part of the file before the checkpoint checked before resuming,
+   and samples of the rest */
+#define CHECKPOINT_TAIL 65536
+#define CHECKPOINT_SAMPLES 16
+#define CHECKPOINT_SAMPLE_SIZE 4096
+
+typedef struct Multihash_job Multihash_job;
+
+typedef struct Multihash_worker {
+    Parhash *ph;
+    Uring *uring;
+    uint8_t *batch_buf;
+    size_t batch_used;
+    unsigned nb_batch;
+    Multihash_job **batch_jobs;
+    const uint8_t **batch_data;
+    size_t *batch_size;
+    Parhash_info **batch_hi;
+} Multihash_worker;
+
+/*
+ * A regular file with several links, or with -E a file sharing all its
+ * extents, so that its data is only hashed for the first path; links are
+ * removed from the table when all of them were seen, clones stay, and
+ * both are freed when all their jobs are output.
+ */
+typedef struct Multihash_link {
+    dev_t dev;
+    uint64_t key[2]; /* inode and 0, or fingerprint of the extents */
+    char *path;
+    nlink_t left; /* links not seen yet, 0 for clones */
+    unsigned refs; /* jobs not output yet */
+    uint8_t in_table;
+    uint8_t clone;
+    uint8_t out[]; /* digests of the first path, concatenated */
+} Multihash_link;
+
 typedef struct Multihash {
     Parhash *ph;
+    Multihash_worker *workers;
+    Scheduler *sched;
+    Throttle *throttle;
     Stat_cache *cache;
+    pthread_mutex_t cache_mutex;
+    /* queued regular files not yet started, in order, as a ring */
+    pthread_mutex_t lookahead_mutex;
+    Multihash_job **lookahead;
+    unsigned lookahead_alloc;
+    unsigned lookahead_head, lookahead_tail;
+    /* with -P, the group of files being sorted, and the reorder buffer
+       that gives them back in walk order */
+    Multihash_job **physical;
+    unsigned nb_physical;
+    Multihash_job **reorder;
+    unsigned walk_seq, reorder_next;
+    /* with -J, the device of each scheduler queue */
+    dev_t devices[DEVICE_QUEUES];
+    unsigned nb_devices;
+    /* in recursive mode, files with several links by device and inode,
+       and with -E clones by device and extents, as an open-addressing
+       hash table */
+    pthread_mutex_t links_mutex;
+    Multihash_link **links;
+    unsigned links_bits;
+    size_t nb_links;
+    size_t link_out_size;
     Formatter *formatter;
     const char *rec_root;
+    unsigned nb_hashes;
+    unsigned batch;
+    unsigned block_threads;
+    unsigned errors;
+    uint8_t failed;
+    /* run statistics for -v, summed from the per-file ones */
+    Parhash_info *total;
+    uint64_t nb_files;
+    double start_time;
     struct Multihash_options {
         const char **exclude;
         size_t nb_exclude;
+        const char *hashes;
+        unsigned jobs;
+        unsigned device_jobs;
+        unsigned walk_threads;
+        uint8_t dont_sync;
+        unsigned threads;
+        size_t block_size;
+        uint64_t max_rate;
+        unsigned max_reads;
+        int nice;
+        uint8_t idle;
+        uint8_t append;
         uint8_t no_cache;
         uint8_t follow;
         uint8_t recursive;
         uint8_t archive;
         uint8_t script;
         uint8_t verbose;
+        uint8_t direct;
+        uint8_t no_mmap;
+        uint8_t physical;
+        uint8_t extents;
     } opt;
 } Multihash;
 
+/*
+ * A file to hash and everything needed to output it once its turn comes.
+ */
+struct Multihash_job {
+    unsigned index;
+    int fd;
+    int ret;
+    char *path;
+    char *rpath;
+    char *rel_path;
+    char *target;
+    const char *type;
+    struct stat st;
+    struct stat cache_st;
+    uint8_t data;
+    uint8_t subtree_skipped;
+    uint8_t block_mode;
+    /* the first path of a file with several links stores the digests in
+       link, the others copy them */
+    Multihash_link *link;
+    uint8_t link_first;
+    /* LOOKAHEAD_* */
+    uint8_t lookahead;
+    /* SCHEDULER_* */
+    unsigned flags;
+    /* with -P, position in the walk and first physical byte */
+    unsigned seq;
+    uint64_t physical;
+    /* in block mode, nb_blocks arrays of one entry per hash, and hi holds
+       the Merkle roots */
+    uint64_t nb_blocks;
+    Parhash_info *blocks;
+    Parhash_info hi[];
+};
+
+#define LOOKAHEAD_QUEUED  1
+#define LOOKAHEAD_HINTED  2
+#define LOOKAHEAD_STARTED 3
+
 typedef struct Stream Stream;
 struct Stream {
+    /* size of the run of zeros skipped at the current position, or 0 and
+       the limit of the next read in max; optional */
+    uint64_t (*zero_run)(Stream *, size_t *max);
     unsigned (*fill_buffer)(Stream *, struct iovec *iov, unsigned niov);
+    /* streams reading ahead fill the Parhash buffer themselves */
+    void (*feed)(Stream *, Parhash *ph);
 };
 
+/*
+ * Holes of a sparse file large enough to be worth skipping, found with
+ * SEEK_HOLE and SEEK_DATA.
+ */
+typedef struct Sparse {
+    int fd;
+    uint8_t active;
+    uint64_t size;
+    uint64_t hole_start, hole_end;
+} Sparse;
+
+static Sparse
+sparse_init(int fd, const struct stat *st)
+{
+    return (Sparse) {
+        .fd = fd,
+        /* files with all their blocks allocated have no holes */
+        .active = S_ISREG(st->st_mode) &&
+            (uint64_t)st->st_blocks * 512 < (uint64_t)st->st_size,
+        .size = st->st_size,
+    };
+}
+
+static void
+sparse_scan_holes(Sparse *sp, uint64_t pos)
+{
+    uint64_t start, end;
+    off_t hole, data;
+
+    while (1) {
+        /* the end of the file counts as a hole */
+        hole = lseek(sp->fd, pos, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole >= sp->size)
+            break;
+        data = lseek(sp->fd, hole, SEEK_DATA);
+        if (data < 0 && errno != ENXIO)
+            break;
+        end = data < 0 || (uint64_t)data > sp->size ? sp->size :
+            (uint64_t)data;
+        /* keep the buffer aligned for O_DIRECT */
+        start = (hole + DIRECT_ALIGN - 1) & ~(uint64_t)(DIRECT_ALIGN - 1);
+        end &= ~(uint64_t)(DIRECT_ALIGN - 1);
+        if (end > start && end - start >= SPARSE_MIN_HOLE) {
+            sp->hole_start = start;
+            sp->hole_end = end;
+            return;
+        }
+        if (data < 0)
+            break;
+        pos = data;
+    }
+    sp->hole_start = sp->hole_end = UINT64_MAX;
+}
+
+static void
+sparse_find_hole(Sparse *sp, uint64_t pos)
+{
+    sparse_scan_holes(sp, pos);
+    /* SEEK_HOLE and SEEK_DATA moved the file offset */
+    if (lseek(sp->fd, pos, SEEK_SET) < 0) {
+        perror("lseek");
+        exit(1);
+    }
+}
+
+static uint64_t
+sparse_zero_run(Sparse *sp, uint64_t pos, size_t *max)
+{
+    if (!sp->active)
+        return 0;
+    if (pos >= sp->hole_end)
+        sparse_find_hole(sp, pos);
+    if (pos == sp->hole_start)
+        return sp->hole_end - pos;
+    if (sp->hole_start - pos < *max)
+        *max = sp->hole_start - pos;
+    return 0;
+}
+
 typedef struct Stream_fd {
     struct Stream stream;
+    Throttle *throttle;
+    Sparse sparse;
+    uint64_t pos;
     int fd;
+    int direct;
 } Stream_fd;
 
+/*
+ * Fall back to normal reads when the file system or the position does
+ * not allow O_DIRECT.
+ */
+static void
+direct_off(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+        perror("fcntl");
+        exit(1);
+    }
+}
+
 static unsigned stream_fd_fill_buffer(Stream *s,
     struct iovec *iov, unsigned niov)
 {
     Stream_fd *s2 = (Stream_fd *)s;
+    size_t trim;
     ssize_t r;
 
+    if (s2->direct) {
+        /* the buffer is aligned, only the size must be */
+        trim = (iov[0].iov_len + (niov > 1 ? iov[1].iov_len : 0)) %
+            DIRECT_ALIGN;
+        if (niov > 1 && iov[1].iov_len > trim) {
+            iov[1].iov_len -= trim;
+        } else {
+            iov[0].iov_len -= trim - (niov > 1 ? iov[1].iov_len : 0);
+            niov = 1;
+        }
+    }
+    throttle_read(s2->throttle, iov[0].iov_len +
+        (niov > 1 ? iov[1].iov_len : 0));
     r = readv(s2->fd, iov, niov);
+    if (r < 0 && errno == EINVAL && s2->direct) {
+        direct_off(s2->fd);
+        s2->direct = 0;
+        r = readv(s2->fd, iov, niov);
+    }
     if (r < 0) {
         perror("read");
         exit(1);
     }
+    s2->pos += r;
     return r;
 }
 
-static Stream_fd stream_fd(int fd)
+static uint64_t stream_fd_zero_run(Stream *s, size_t *max)
 {
+    Stream_fd *s2 = (Stream_fd *)s;
+    uint64_t run;
+
+    run = sparse_zero_run(&s2->sparse, s2->pos, max);
+    if (run > 0) {
+        s2->pos += run;
+        if (lseek(s2->fd, s2->pos, SEEK_SET) < 0) {
+            perror("lseek");
+            exit(1);
+        }
+    }
+    return run;
+}
+
+static Stream_fd stream_fd(int fd, int direct, Throttle *throttle,
+    const struct stat *st)
+{
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+
     return (Stream_fd) {
+        .stream.zero_run = stream_fd_zero_run,
         .stream.fill_buffer = stream_fd_fill_buffer,
+        .throttle = throttle,
+        .sparse = sparse_init(fd, st),
+        .pos = pos < 0 ? 0 : pos,
         .fd = fd,
+        .direct = direct,
     };
 }
 
+typedef struct Uring_read {
+    struct iovec iov[2];
+    unsigned niov;
+    size_t size;
+    uint64_t offset;
+    int res;
+    uint8_t done;
+} Uring_read;
+
+typedef struct Stream_uring {
+    struct Stream stream;
+    Uring *uring;
+    Throttle *throttle;
+    Sparse sparse;
+    int fd;
+    int direct;
+} Stream_uring;
+
+/*
+ * Complete a short read synchronously, so that the following reads are
+ * still at the right place in the buffer; returns the total size read,
+ * less than the requested size only at the end of the file.
+ */
+static size_t
+uring_read_complete(int fd, Uring_read *rd, size_t done)
+{
+    uint8_t *buf;
+    size_t size;
+    ssize_t r;
+
+    while (done < rd->size) {
+        if (done < rd->iov[0].iov_len) {
+            buf = (uint8_t *)rd->iov[0].iov_base + done;
+            size = rd->iov[0].iov_len - done;
+        } else {
+            buf = (uint8_t *)rd->iov[1].iov_base + (done - rd->iov[0].iov_len);
+            size = rd->size - done;
+        }
+        r = pread(fd, buf, size, rd->offset + done);
+        if (r < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+/*
+ * Keep up to URING_DEPTH reads in flight in the free part of the buffer;
+ * they are handed to the hashes in order as they complete.
+ */
 static void
-multihash_output(Multihash *mh, unsigned index, const char *path)
+stream_uring_feed(Stream *s, Parhash *ph)
+{
+    Stream_uring *s2 = (Stream_uring *)s;
+    Uring_read rd[URING_DEPTH], *r;
+    uint64_t offset, user_data, zero = 0;
+    size_t queued = 0, size, max;
+    unsigned head = 0, nb = 0;
+    int eof = 0, res;
+    off_t pos;
+
+    pos = lseek(s2->fd, 0, SEEK_CUR);
+    offset = pos < 0 ? 0 : pos;
+    while (!eof || nb > 0) {
+        /* a hole is given to the hashes after the reads before it */
+        if (zero > 0 && nb == 0) {
+            parhash_zero(ph, zero);
+            offset += zero;
+            zero = 0;
+        }
+        while (!eof && zero == 0 && nb < URING_DEPTH &&
+               parhash_poll_buffer(ph, queued + URING_READ)) {
+            max = URING_READ;
+            zero = sparse_zero_run(&s2->sparse, offset, &max);
+            if (zero > 0)
+                break;
+            r = &rd[(head + nb) % URING_DEPTH];
+            r->niov = parhash_peek_buffer(ph, queued, max,
+                &r->iov[0].iov_base, &r->iov[0].iov_len,
+                &r->iov[1].iov_base, &r->iov[1].iov_len);
+            r->size = r->iov[0].iov_len +
+                (r->niov > 1 ? r->iov[1].iov_len : 0);
+            r->offset = offset;
+            r->done = 0;
+            throttle_read(s2->throttle, r->size);
+            uring_readv(s2->uring, s2->fd, r->iov, r->niov, offset,
+                (head + nb) % URING_DEPTH);
+            offset += r->size;
+            queued += r->size;
+            nb++;
+        }
+        if (nb == 0) {
+            if (zero == 0)
+                parhash_wait_buffer(ph, URING_READ);
+            continue;
+        }
+        if (uring_submit(s2->uring, rd[head].done ? 0 : 1) < 0) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        while (uring_reap(s2->uring, &user_data, &res)) {
+            rd[user_data].res = res;
+            rd[user_data].done = 1;
+        }
+        while (nb > 0 && rd[head].done) {
+            r = &rd[head];
+            if (r->res == -EINVAL && s2->direct) {
+                if (s2->direct == 1)
+                    direct_off(s2->fd);
+                s2->direct = 2;
+                r->res = 0;
+            }
+            if (r->res < 0) {
+                errno = -r->res;
+                perror("read");
+                exit(1);
+            }
+            if (!eof) {
+                size = r->res;
+                if (size < r->size)
+                    size = uring_read_complete(s2->fd, r, size);
+                if (size < r->size)
+                    eof = 1;
+                parhash_advance(ph, size);
+            }
+            /* after the end, the rest of the reads are only reaped */
+            queued -= r->size;
+            head = (head + 1) % URING_DEPTH;
+            nb--;
+        }
+    }
+}
+
+/* after falling back from O_DIRECT, direct is 2 */
+static Stream_uring stream_uring(Uring *uring, int fd, int direct,
+    Throttle *throttle, const struct stat *st)
+{
+    return (Stream_uring) {
+        .stream.feed = stream_uring_feed,
+        .uring = uring,
+        .throttle = throttle,
+        .sparse = sparse_init(fd, st),
+        .fd = fd,
+        .direct = direct,
+    };
+}
+
+static void
+multihash_output(Multihash *mh, const Parhash_info *hi, unsigned index,
+    const char *path)
 {
-    Parhash_info *hi;
     char buf[512 / 4 + 1];
     unsigned i, j;
 
@@ -92,15 +563,15 @@ multihash_output(Multihash *mh, unsigned index, const char *path)
         formatter_dict_item(mh->formatter, "hash");
         formatter_dict_open(mh->formatter);
     }
-    for (i = 0; (hi = parhash_get_info(mh->ph, i)) != NULL; i++) {
-        assert(sizeof(buf) > hi->size * 2);
-        for (j = 0; j < hi->size; j++)
-            snprintf(buf + j * 2, 3, "%02x", hi->out[j]);
+    for (i = 0; i < mh->nb_hashes; i++) {
+        assert(sizeof(buf) > hi[i].size * 2);
+        for (j = 0; j < hi[i].size; j++)
+            snprintf(buf + j * 2, 3, "%02x", hi[i].out[j]);
         if (mh->formatter) {
-            formatter_dict_item(mh->formatter, hi->name);
+            formatter_dict_item(mh->formatter, hi[i].name);
             formatter_string(mh->formatter, buf);
         } else {
-            printf("%s:%s  ", hi->name, buf);
+            printf("%s:%s  ", hi[i].name, buf);
             if (mh->opt.script)
                 printf("%09d\n", index);
             else
@@ -112,18 +583,149 @@ multihash_output(Multihash *mh, unsigned index, const char *path)
     }
 }
 
+static void
+multihash_output_blocks(Multihash *mh, Multihash_job *job)
+{
+    char buf[512 / 4 + 1];
+    const Parhash_info *hi;
+    uint64_t b;
+    unsigned i, j;
+
+    formatter_dict_item(mh->formatter, "block_size");
+    formatter_integer(mh->formatter, mh->opt.block_size);
+    formatter_dict_item(mh->formatter, "blocks");
+    formatter_array_open(mh->formatter);
+    for (b = 0; b < job->nb_blocks; b++) {
+        hi = job->blocks + b * mh->nb_hashes;
+        formatter_array_item(mh->formatter);
+        formatter_dict_open(mh->formatter);
+        for (i = 0; i < mh->nb_hashes; i++) {
+            for (j = 0; j < hi[i].size; j++)
+                snprintf(buf + j * 2, 3, "%02x", hi[i].out[j]);
+            formatter_dict_item(mh->formatter, hi[i].name);
+            formatter_string(mh->formatter, buf);
+        }
+        formatter_dict_close(mh->formatter);
+    }
+    formatter_array_close(mh->formatter);
+    formatter_dict_item(mh->formatter, "merkle");
+    formatter_dict_open(mh->formatter);
+    for (i = 0; i < mh->nb_hashes; i++) {
+        for (j = 0; j < job->hi[i].size; j++)
+            snprintf(buf + j * 2, 3, "%02x", job->hi[i].out[j]);
+        formatter_dict_item(mh->formatter, job->hi[i].name);
+        formatter_string(mh->formatter, buf);
+    }
+    formatter_dict_close(mh->formatter);
+}
+
+static void
+multihash_collect(Multihash *mh, Parhash *ph, Parhash_info *hi)
+{
+    unsigned i;
+
+    for (i = 0; i < mh->nb_hashes; i++)
+        if (!hi[i].disabled)
+            hi[i] = *parhash_get_info(ph, i);
+}
+
+static double
+multihash_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+static void
+multihash_verbose_hash(const char *prefix, const Parhash_info *hi)
+{
+    fprintf(stderr, "%s%s: %.3fs cpu, %.3fs idle, %.3fs stall, "
+        "%llu bytes\n", prefix, hi->name,
+        hi->utime_sec + hi->utime_msec / 1E6,
+        hi->idle_usec / 1E6, hi->stall_usec / 1E6,
+        (unsigned long long)hi->bytes);
+}
+
+static void
+multihash_verbose(Multihash *mh, const Parhash_info *hi)
+{
+    Parhash_info *t;
+    uint64_t usec;
+    unsigned i;
+
+    if (!mh->opt.verbose)
+        return;
+    mh->nb_files++;
+    for (i = 0; i < mh->nb_hashes; i++) {
+        if (hi[i].disabled)
+            continue;
+        multihash_verbose_hash("", &hi[i]);
+        t = &mh->total[i];
+        usec = t->utime_msec + hi[i].utime_msec;
+        t->utime_sec += hi[i].utime_sec + usec / 1000000;
+        t->utime_msec = usec % 1000000;
+        t->idle_usec += hi[i].idle_usec;
+        t->stall_usec += hi[i].stall_usec;
+        t->bytes += hi[i].bytes;
+    }
+}
+
+/*
+ * A hash with much stall is the bottleneck of the ring; hashes that are
+ * mostly idle mean the run is limited by the input.
+ */
+static void
+multihash_verbose_total(Multihash *mh)
+{
+    uint64_t bytes = 0, reads;
+    double elapsed, waited;
+    unsigned i;
+
+    if (!mh->opt.verbose)
+        return;
+    elapsed = multihash_clock() - mh->start_time;
+    for (i = 0; i < mh->nb_hashes; i++)
+        if (mh->total[i].bytes > bytes)
+            bytes = mh->total[i].bytes;
+    fprintf(stderr, "total: %llu files, %.3fs elapsed, %.1f MB/s\n",
+        (unsigned long long)mh->nb_files, elapsed,
+        elapsed > 0 ? bytes / elapsed / 1E6 : 0);
+    for (i = 0; i < mh->nb_hashes; i++)
+        multihash_verbose_hash("total ", &mh->total[i]);
+    if (mh->throttle != NULL) {
+        throttle_get_stats(mh->throttle, &bytes, &reads, &waited);
+        fprintf(stderr, "throttle: %.1f MB/s, %.1f reads/s, "
+            "%.3fs waited\n", elapsed > 0 ? bytes / elapsed / 1E6 : 0,
+            elapsed > 0 ? reads / elapsed : 0, waited);
+    }
+}
+
 static void
 multihash_stream_data(Parhash *ph, Stream *s)
 {
     struct iovec iov[2];
+    uint64_t zero;
     unsigned n, rd;
+    size_t max;
 
     if (parhash_start(ph) < 0)
         exit(1);
+    if (s->feed != NULL) {
+        s->feed(s, ph);
+        parhash_finish(ph);
+        return;
+    }
     while (1) {
-        parhash_wait_buffer(ph, MIN_READ);
         /* Do net read too much at once to avoid starving the threads */
-        n = parhash_get_buffer(ph, MAX_READ,
+        max = MAX_READ;
+        if (s->zero_run != NULL && (zero = s->zero_run(s, &max)) > 0) {
+            parhash_zero(ph, zero);
+            continue;
+        }
+        parhash_wait_buffer(ph, MIN_READ);
+        n = parhash_get_buffer(ph, max,
             &iov[0].iov_base, &iov[0].iov_len,
             &iov[1].iov_base, &iov[1].iov_len);
         rd = s->fill_buffer(s, iov, n);
@@ -131,97 +733,593 @@ multihash_stream_data(Parhash *ph, Stream *s)
             break;
         parhash_advance(ph, rd);
     }
-    parhash_finish(ph);
+    parhash_finish(ph);
+}
+
+static Multihash_job *
+multihash_job_alloc(Multihash *mh)
+{
+    Multihash_job *job;
+    Parhash_info *hi;
+    unsigned i;
+
+    job = calloc(1, sizeof(*job) + mh->nb_hashes * sizeof(*job->hi));
+    if (job == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    job->fd = -1;
+    for (i = 0; i < mh->nb_hashes; i++) {
+        hi = parhash_get_info(mh->ph != NULL ? mh->ph : mh->workers[0].ph, i);
+        job->hi[i].name = hi->name;
+        job->hi[i].size = hi->size;
+    }
+    return job;
+}
+
+static void
+multihash_job_free(Multihash_job *job)
+{
+    if (job->fd >= 0)
+        close(job->fd);
+    free(job->path);
+    free(job->rpath);
+    free(job->rel_path);
+    free(job->target);
+    free(job->blocks);
+    free(job);
+}
+
+/*
+ * Look the file up in the cache; returns the number of hashes left to
+ * compute, or -1 on error.
+ */
+static int
+multihash_file_prepare(Multihash *mh, Multihash_job *job)
+{
+    Parhash_info *hi;
+    unsigned i;
+    int ret, todo = 0;
+
+    /* without rpath, the cache is not used, and stdin never is */
+    if (mh->opt.no_cache || strcmp(job->path, "-") == 0)
+        return mh->nb_hashes;
+    job->rpath = realpath(job->path, NULL);
+    if (job->rpath == NULL) {
+        perror(job->path);
+        return -1;
+    }
+    if (stat(job->rpath, &job->cache_st) < 0) {
+        perror(job->rpath);
+        return -1;
+    }
+    pthread_mutex_lock(&mh->cache_mutex);
+    for (i = 0; i < mh->nb_hashes; i++) {
+        hi = &job->hi[i];
+        ret = stat_cache_get(mh->cache, job->rpath, &job->cache_st,
+            hi->name, hi->out, hi->size);
+        hi->disabled = ret > 0;
+        if (!hi->disabled)
+            todo++;
+    }
+    pthread_mutex_unlock(&mh->cache_mutex);
+    return todo;
+}
+
+/*
+ * Reads from a pipe are at most as large as the pipe; enlarge it, the
+ * system may refuse or limit it.
+ */
+static void
+pipe_grow(int fd)
+{
+#ifdef F_SETPIPE_SZ
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+        fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+#else
+    (void)fd;
+#endif
+}
+
+static int
+multihash_file_open(Multihash_job *job)
+{
+    if (job->fd < 0 && strcmp(job->path, "-") == 0) {
+        /* a duplicate, closed like the files */
+        job->fd = dup(0);
+        if (job->fd < 0) {
+            perror("dup");
+            exit(1);
+        }
+        pipe_grow(job->fd);
+    }
+    if (job->fd < 0) {
+        job->fd = open(job->path, O_RDONLY);
+        if (job->fd < 0) {
+            perror(job->path);
+            return -1;
+        }
+    }
+    if (fstat(job->fd, &job->cache_st) < 0) {
+        perror("fstat");
+        exit(1);
+    }
+    return 0;
+}
+
+/*
+ * Fingerprint of the data covered by a checkpoint, to detect files that
+ * were rewritten rather than appended to: the end of the data and a few
+ * samples spread over the rest.
+ */
+static int
+multihash_checkpoint_tail(int fd, uint64_t offset, uint8_t *out)
+{
+    uint8_t buf[CHECKPOINT_TAIL];
+    size_t size = offset < sizeof(buf) ? offset : sizeof(buf);
+    uint64_t pos;
+    Xxh3_state xxh;
+    unsigned i;
+
+    xxh3_init(&xxh);
+    if (pread(fd, buf, size, offset - size) != (ssize_t)size)
+        return -1;
+    xxh3_update(&xxh, buf, size);
+    for (i = 0; i < CHECKPOINT_SAMPLES && offset > sizeof(buf); i++) {
+        pos = (offset - sizeof(buf)) / CHECKPOINT_SAMPLES * i;
+        if (pread(fd, buf, CHECKPOINT_SAMPLE_SIZE, pos) !=
+            CHECKPOINT_SAMPLE_SIZE)
+            return -1;
+        xxh3_update(&xxh, buf, CHECKPOINT_SAMPLE_SIZE);
+    }
+    xxh3_final(&xxh, out);
+    return 0;
+}
+
+/*
+ * Checkpoints are stored under the name of the hash and the format of the
+ * states, so that the states of another build are not found.
+ */
+static void
+multihash_checkpoint_name(char *name, size_t size, const char *hash)
+{
+    char format[64];
+
+    parhash_state_format(format, sizeof(format));
+    snprintf(name, size, "%s#%s", hash, format);
+}
+
+/*
+ * A checkpoint is the offset, the tail fingerprint and the hash state.
+ * Returns the offset where to resume hashing, with the states loaded in
+ * the Parhash and the file positioned, or 0.
+ */
+static uint64_t
+multihash_checkpoint_load(Multihash *mh, Multihash_worker *w,
+    Multihash_job *job)
+{
+    size_t rec_size = 8 + 16 + parhash_state_size();
+    uint8_t *rec, tail[16];
+    uint64_t offset = 0, o;
+    char name[128];
+    unsigned i;
+    int ret;
+
+    if (!mh->opt.append || job->rpath == NULL ||
+        !S_ISREG(job->cache_st.st_mode) ||
+        job->cache_st.st_size < CHECKPOINT_MIN_SIZE)
+        return 0;
+    rec = malloc(mh->nb_hashes * rec_size);
+    if (rec == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < mh->nb_hashes; i++) {
+        if (job->hi[i].disabled)
+            continue;
+        multihash_checkpoint_name(name, sizeof(name), job->hi[i].name);
+        pthread_mutex_lock(&mh->cache_mutex);
+        ret = stat_cache_get_checkpoint(mh->cache, job->rpath, &job->cache_st,
+            name, rec + i * rec_size, rec_size);
+        pthread_mutex_unlock(&mh->cache_mutex);
+        if (ret <= 0)
+            goto fail;
+        memcpy(&o, rec + i * rec_size, 8);
+        if (offset != 0 && o != offset)
+            goto fail;
+        offset = o;
+    }
+    /* a file of the same size was rewritten, not appended to */
+    if (offset == 0 || offset >= (uint64_t)job->cache_st.st_size ||
+        multihash_checkpoint_tail(job->fd, offset, tail) < 0)
+        goto fail;
+    for (i = 0; i < mh->nb_hashes; i++)
+        if (!job->hi[i].disabled &&
+            memcmp(rec + i * rec_size + 8, tail, 16) != 0)
+            goto fail;
+    if (lseek(job->fd, offset, SEEK_SET) < 0)
+        goto fail;
+    for (i = 0; i < mh->nb_hashes; i++)
+        if (!job->hi[i].disabled)
+            parhash_load_state(w->ph, i, rec + i * rec_size + 24);
+    free(rec);
+    return offset;
+
+fail:
+    free(rec);
+    return 0;
+}
+
+static void
+multihash_checkpoint_save(Multihash *mh, Multihash_worker *w,
+    Multihash_job *job, uint64_t offset)
+{
+    size_t rec_size = 8 + 16 + parhash_state_size();
+    uint8_t *rec;
+    char name[128];
+    unsigned i;
+
+    if (!mh->opt.append)
+        return;
+    for (i = 0; i < mh->nb_hashes; i++)
+        if (!job->hi[i].disabled)
+            break;
+    if (i == mh->nb_hashes)
+        return;
+    offset += job->hi[i].bytes;
+    if (job->rpath == NULL || offset < CHECKPOINT_MIN_SIZE)
+        return;
+    rec = malloc(rec_size);
+    if (rec == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(rec, &offset, 8);
+    if (multihash_checkpoint_tail(job->fd, offset, rec + 8) < 0) {
+        free(rec);
+        return;
+    }
+    for (i = 0; i < mh->nb_hashes; i++) {
+        if (job->hi[i].disabled)
+            continue;
+        parhash_save_state(w->ph, i, rec + 24);
+        multihash_checkpoint_name(name, sizeof(name), job->hi[i].name);
+        pthread_mutex_lock(&mh->cache_mutex);
+        stat_cache_set_checkpoint(mh->cache, job->rpath, &job->cache_st,
+            name, rec, rec_size);
+        pthread_mutex_unlock(&mh->cache_mutex);
+    }
+    free(rec);
+}
+
+/*
+ * Map the file if it is mostly in the page cache.
+ */
+static uint8_t *
+multihash_map_resident(int fd, uint64_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE), nb_pages, nb, missing = 0, max, i;
+    unsigned char vec[4096];
+    uint8_t *map;
+    size_t pos;
+
+    if (size > SIZE_MAX)
+        return NULL;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    nb_pages = (size + page - 1) / page;
+    max = nb_pages - nb_pages * MAPPED_RESIDENT / 256;
+    for (pos = 0; pos < nb_pages; pos += nb) {
+        nb = nb_pages - pos < sizeof(vec) ? nb_pages - pos : sizeof(vec);
+        if (mincore(map + pos * page, nb * page, vec) < 0)
+            goto fail;
+        for (i = 0; i < nb; i++)
+            missing += !(vec[i] & 1);
+        if (missing > max)
+            goto fail;
+    }
+    return map;
+
+fail:
+    munmap(map, size);
+    return NULL;
+}
+
+/*
+ * Hash a file that is already cached directly from a mapping, without
+ * copying it; returns 1 if done, 0 if the file must be read, -1 if it
+ * changed while hashed.
+ */
+static int
+multihash_file_mapped(Multihash *mh, Multihash_worker *w, Multihash_job *job,
+    uint64_t offset)
+{
+    uint64_t size = job->cache_st.st_size;
+    struct stat st;
+    uint8_t *map;
+    int ret;
+
+    if (mh->opt.direct || mh->opt.no_mmap ||
+        !S_ISREG(job->cache_st.st_mode) || size - offset <= SMALL_FILE_SIZE)
+        return 0;
+    map = multihash_map_resident(job->fd, size);
+    if (map == NULL)
+        return 0;
+    ret = parhash_hash_mapped(w->ph, map + offset, size - offset);
+    munmap(map, size);
+    if (ret < 0)
+        return -1;
+    /* data appended meanwhile would be missed */
+    if (fstat(job->fd, &st) < 0) {
+        perror("fstat");
+        exit(1);
+    }
+    return st.st_size == job->cache_st.st_size ? 1 : -1;
+}
+
+static void
+multihash_file_stream(Multihash *mh, Multihash_worker *w, Multihash_job *job)
+{
+    Stream_fd s;
+    Stream_uring su;
+    uint64_t offset;
+    unsigned i;
+    int ret, flags, direct = 0;
+
+    for (i = 0; i < mh->nb_hashes; i++)
+        parhash_get_info(w->ph, i)->disabled = job->hi[i].disabled;
+    offset = multihash_checkpoint_load(mh, w, job);
+    ret = multihash_file_mapped(mh, w, job, offset);
+    if (ret > 0) {
+        multihash_collect(mh, w->ph, job->hi);
+        multihash_checkpoint_save(mh, w, job, offset);
+        return;
+    }
+    if (ret < 0) {
+        /* the file changed: start again, reading it */
+        if (fstat(job->fd, &job->cache_st) < 0) {
+            perror("fstat");
+            exit(1);
+        }
+        offset = multihash_checkpoint_load(mh, w, job);
+        if (lseek(job->fd, offset, SEEK_SET) < 0) {
+            perror("lseek");
+            exit(1);
+        }
+    }
+    if (mh->opt.direct && S_ISREG(job->cache_st.st_mode)) {
+        /* file systems without O_DIRECT refuse it here */
+        flags = fcntl(job->fd, F_GETFL);
+        direct = flags >= 0 &&
+            fcntl(job->fd, F_SETFL, flags | O_DIRECT) >= 0;
+    }
+    if (!direct) {
+        posix_fadvise(job->fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+        /* the kernel would read the whole file past the throttle */
+        if (mh->throttle == NULL)
+            posix_fadvise(job->fd, offset, 0, POSIX_FADV_WILLNEED);
+        posix_fadvise(job->fd, offset, 0, POSIX_FADV_NOREUSE);
+    }
+    if (w->uring != NULL && S_ISREG(job->cache_st.st_mode)) {
+        su = stream_uring(w->uring, job->fd, direct, mh->throttle,
+            &job->cache_st);
+        multihash_stream_data(w->ph, &su.stream);
+        direct = su.direct == 1;
+    } else {
+        s = stream_fd(job->fd, direct, mh->throttle, &job->cache_st);
+        multihash_stream_data(w->ph, &s.stream);
+        direct = s.direct;
+    }
+    if (direct)
+        direct_off(job->fd);
+    multihash_collect(mh, w->ph, job->hi);
+    multihash_checkpoint_save(mh, w, job, offset);
 }
 
-static int
-multihash_file_data(Parhash *ph, int fd, struct stat *st)
+static void
+multihash_file_finish(Multihash *mh, Multihash_job *job)
 {
-    Stream_fd s = stream_fd(fd);
+    Parhash_info *hi;
+    unsigned i;
 
-    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
-    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
-    multihash_stream_data(ph, &s.stream);
-    if (fstat(fd, st) < 0) {
+    if (job->rpath == NULL)
+        return;
+    if (job->fd >= 0 && fstat(job->fd, &job->cache_st) < 0) {
         perror("fstat");
         exit(1);
     }
-    return 0;
+    pthread_mutex_lock(&mh->cache_mutex);
+    for (i = 0; i < mh->nb_hashes; i++) {
+        hi = &job->hi[i];
+        if (!hi->disabled)
+            stat_cache_set(mh->cache, job->rpath, &job->cache_st,
+                hi->name, hi->out, hi->size);
+    }
+    pthread_mutex_unlock(&mh->cache_mutex);
 }
 
+/*
+ * Read a small file into the batch; returns 1 if it was added, 0 if it
+ * turned out to be larger than expected and must be streamed, -1 if the
+ * batch has no room left for it.
+ */
 static int
-multihash_file_data_from_path(Parhash *ph, const char *path, struct stat *st)
+multihash_batch_add(Multihash *mh, Multihash_worker *w, Multihash_job *job)
 {
-    int fd, ret;
+    uint8_t *buf = w->batch_buf + w->batch_used;
+    size_t want = job->cache_st.st_size + 1, size = 0;
+    ssize_t r;
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        perror(path);
-        return 1;
+    if (want > BATCH_BUF_SIZE - w->batch_used)
+        return -1;
+    throttle_read(mh->throttle, want);
+    while (size < want) {
+        r = read(job->fd, buf + size, want - size);
+        if (r < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (r == 0)
+            break;
+        size += r;
+    }
+    if (size == want) {
+        if (lseek(job->fd, 0, SEEK_SET) < 0) {
+            perror("lseek");
+            exit(1);
+        }
+        return 0;
     }
-    ret = multihash_file_data(ph, fd, st);
-    close(fd);
-    return ret;
+    w->batch_jobs[w->nb_batch] = job;
+    w->batch_data[w->nb_batch] = buf;
+    w->batch_size[w->nb_batch] = size;
+    w->batch_hi[w->nb_batch] = job->hi;
+    w->nb_batch++;
+    w->batch_used += size;
+    return 1;
 }
 
-static int
-multihash_file(Multihash *mh, unsigned index, const char *path, int fd)
+static void
+multihash_batch_flush(Multihash *mh, Multihash_worker *w)
 {
-    Parhash_info *hi;
-    char *rpath = NULL;
-    struct stat st;
-    unsigned i, todo;
+    unsigned i;
+
+    if (w->nb_batch == 0)
+        return;
+    parhash_hash_buffers(w->ph, w->nb_batch, w->batch_data, w->batch_size,
+        w->batch_hi);
+    for (i = 0; i < w->nb_batch; i++)
+        multihash_file_finish(mh, w->batch_jobs[i]);
+    w->nb_batch = 0;
+    w->batch_used = 0;
+}
+
+/*
+ * Hash a large file by blocks on all the cores; the block lists are
+ * cached under the name of the hash with the block size.
+ */
+static void
+multihash_file_blocks(Multihash *mh, Multihash_worker *w, Multihash_job *job)
+{
+    Parhash_info *hi, *info;
+    uint8_t *list;
+    char name[64];
+    uint64_t b;
+    unsigned i, todo = mh->nb_hashes;
     int ret;
 
-    if (mh->opt.no_cache) {
-        for (i = 0; (hi = parhash_get_info(mh->ph, i)) != NULL; i++)
-            hi->disabled = 0;
-        todo = i;
-    } else {
-        rpath = realpath(path, NULL);
-        if (rpath == NULL) {
-            perror(path);
-            return 1;
-        }
-        if (stat(rpath, &st) < 0) {
-            perror(rpath);
-            free(rpath);
-            return 1;
-        }
-        todo = 0;
-        for (i = 0; (hi = parhash_get_info(mh->ph, i)) != NULL; i++) {
-            hi->disabled = 0;
-            ret = stat_cache_get(mh->cache, rpath, &st,
-                hi->name, hi->out, hi->size);
-            if (ret > 0)
-                hi->disabled = 1;
-            if (!hi->disabled)
-                todo++;
+    if (multihash_file_open(job) < 0) {
+        job->ret = 1;
+        return;
+    }
+    if (!mh->opt.no_cache) {
+        job->rpath = realpath(job->path, NULL);
+        if (job->rpath == NULL) {
+            perror(job->path);
+            job->ret = 1;
+            return;
         }
     }
-    if (todo) {
-        ret = fd < 0 ? multihash_file_data_from_path(mh->ph, path, &st) :
-            multihash_file_data(mh->ph, fd, &st);
-        if (ret != 0) {
-            free(rpath);
-            return 1;
+    job->nb_blocks = job->cache_st.st_size == 0 ? 1 :
+        (job->cache_st.st_size + mh->opt.block_size - 1) / mh->opt.block_size;
+    job->blocks = calloc(job->nb_blocks * mh->nb_hashes, sizeof(*job->blocks));
+    list = malloc(job->nb_blocks * sizeof(hi->out));
+    if (job->blocks == NULL || list == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < mh->nb_hashes; i++) {
+        info = parhash_get_info(w->ph, i);
+        for (b = 0; b < job->nb_blocks; b++) {
+            hi = &job->blocks[b * mh->nb_hashes + i];
+            hi->name = info->name;
+            hi->size = info->size;
+        }
+        if (mh->opt.no_cache)
+            continue;
+        snprintf(name, sizeof(name), "%s@%zu", info->name, mh->opt.block_size);
+        pthread_mutex_lock(&mh->cache_mutex);
+        ret = stat_cache_get(mh->cache, job->rpath, &job->cache_st, name,
+            list, job->nb_blocks * info->size);
+        pthread_mutex_unlock(&mh->cache_mutex);
+        if (ret <= 0)
+            continue;
+        for (b = 0; b < job->nb_blocks; b++) {
+            hi = &job->blocks[b * mh->nb_hashes + i];
+            memcpy(hi->out, list + b * info->size, info->size);
+            hi->disabled = 1;
         }
+        todo--;
     }
-    multihash_output(mh, index, path);
-    for (i = 0; (hi = parhash_get_info(mh->ph, i)) != NULL; i++) {
-        if (!mh->opt.no_cache && !hi->disabled)
-            stat_cache_set(mh->cache, rpath, &st, hi->name, hi->out, hi->size);
+    if (todo > 0) {
+        if (blockhash_file(w->ph, job->fd, job->cache_st.st_size,
+            mh->opt.block_size, mh->block_threads, mh->throttle,
+            job->blocks) < 0) {
+            perror(job->path);
+            job->ret = 1;
+            free(list);
+            return;
+        }
+        if (!mh->opt.no_cache) {
+            if (fstat(job->fd, &job->cache_st) < 0) {
+                perror("fstat");
+                exit(1);
+            }
+            for (i = 0; i < mh->nb_hashes; i++) {
+                if (job->blocks[i].disabled)
+                    continue;
+                for (b = 0; b < job->nb_blocks; b++)
+                    memcpy(list + b * job->hi[i].size,
+                        job->blocks[b * mh->nb_hashes + i].out,
+                        job->hi[i].size);
+                snprintf(name, sizeof(name), "%s@%zu", job->hi[i].name,
+                    mh->opt.block_size);
+                pthread_mutex_lock(&mh->cache_mutex);
+                stat_cache_set(mh->cache, job->rpath, &job->cache_st, name,
+                    list, job->nb_blocks * job->hi[i].size);
+                pthread_mutex_unlock(&mh->cache_mutex);
+            }
+        }
     }
-    if (mh->opt.verbose) {
-        for (i = 0; (hi = parhash_get_info(mh->ph, i)) != NULL; i++)
-            if (!hi->disabled)
-                fprintf(stderr, "%s: %.3fs\n", hi->name,
-                    hi->utime_sec + hi->utime_msec / 1E6);
+    free(list);
+    parhash_merkle(w->ph, job->nb_blocks, job->blocks, job->hi);
+}
+
+static void
+multihash_file(Multihash *mh, Multihash_worker *w, Multihash_job *job)
+{
+    const struct stat *st = &job->cache_st;
+    int ret;
+
+    if (job->block_mode) {
+        multihash_file_blocks(mh, w, job);
+        return;
     }
-    free(rpath);
-    fflush(stdout);
-    return 0;
+    ret = multihash_file_prepare(mh, job);
+    if (ret < 0) {
+        job->ret = 1;
+        return;
+    }
+    if (ret > 0) {
+        if (multihash_file_open(job) < 0) {
+            job->ret = 1;
+            return;
+        }
+        if (S_ISREG(st->st_mode) && st->st_size <= SMALL_FILE_SIZE) {
+            ret = multihash_batch_add(mh, w, job);
+            if (ret < 0) {
+                multihash_batch_flush(mh, w);
+                ret = multihash_batch_add(mh, w, job);
+            }
+            if (ret > 0)
+                return;
+        }
+        multihash_file_stream(mh, w, job);
+    }
+    multihash_file_finish(mh, job);
 }
 
 static void
@@ -252,15 +1350,394 @@ multihash_file_stat(Multihash *mh, const char *path, const char *type,
     formatter_string(mh->formatter, mode_str);
 }
 
+/*
+ * Get the kernel reading the next LOOKAHEAD_FILES queued files that are
+ * not started yet; called with lookahead_mutex held, which guarantees
+ * the descriptors are still open.
+ */
+static void
+multihash_lookahead_hint(Multihash *mh)
+{
+    Multihash_job *job;
+    unsigned pos, ahead = 0;
+    off_t size;
+
+    for (pos = mh->lookahead_head;
+         pos != mh->lookahead_tail && ahead < LOOKAHEAD_FILES; pos++) {
+        job = mh->lookahead[pos % mh->lookahead_alloc];
+        if (job->lookahead == LOOKAHEAD_STARTED)
+            continue;
+        ahead++;
+        if (job->lookahead == LOOKAHEAD_HINTED)
+            continue;
+        size = job->st.st_size < LOOKAHEAD_SIZE ? job->st.st_size :
+            LOOKAHEAD_SIZE;
+        posix_fadvise(job->fd, 0, size, POSIX_FADV_WILLNEED);
+        job->lookahead = LOOKAHEAD_HINTED;
+    }
+}
+
+static void
+multihash_lookahead_queue(Multihash *mh, Multihash_job *job)
+{
+    pthread_mutex_lock(&mh->lookahead_mutex);
+    /* the ring is larger than the scheduler window */
+    assert(mh->lookahead_tail - mh->lookahead_head < mh->lookahead_alloc);
+    job->lookahead = LOOKAHEAD_QUEUED;
+    mh->lookahead[mh->lookahead_tail++ % mh->lookahead_alloc] = job;
+    multihash_lookahead_hint(mh);
+    pthread_mutex_unlock(&mh->lookahead_mutex);
+}
+
+/*
+ * Jobs are output in order, so a started job cannot be freed before all
+ * the ones queued before it are started and out of the ring.
+ */
+static void
+multihash_lookahead_start(Multihash *mh, void **jobs, unsigned nb)
+{
+    Multihash_job *job;
+    unsigned i;
+
+    if (mh->lookahead == NULL)
+        return;
+    pthread_mutex_lock(&mh->lookahead_mutex);
+    for (i = 0; i < nb; i++) {
+        job = jobs[i];
+        if (job->lookahead != 0)
+            job->lookahead = LOOKAHEAD_STARTED;
+    }
+    while (mh->lookahead_head != mh->lookahead_tail &&
+        mh->lookahead[mh->lookahead_head % mh->lookahead_alloc]->lookahead ==
+        LOOKAHEAD_STARTED)
+        mh->lookahead_head++;
+    multihash_lookahead_hint(mh);
+    pthread_mutex_unlock(&mh->lookahead_mutex);
+}
+
+static void
+multihash_job_process(void *mh_v, unsigned worker, void **jobs, unsigned nb)
+{
+    Multihash *mh = mh_v;
+    Multihash_worker *w = &mh->workers[worker];
+    Multihash_job *job;
+    unsigned i;
+
+    multihash_lookahead_start(mh, jobs, nb);
+    for (i = 0; i < nb; i++)
+        multihash_file(mh, w, jobs[i]);
+    multihash_batch_flush(mh, w);
+    for (i = 0; i < nb; i++) {
+        job = jobs[i];
+        if (job->fd >= 0)
+            close(job->fd);
+        job->fd = -1;
+    }
+}
+
+static size_t
+multihash_link_home(Multihash *mh, dev_t dev, const uint64_t *key)
+{
+    uint64_t h = (key[0] ^ key[1] * UINT64_C(0xC2B2AE3D27D4EB4F) ^
+        (uint64_t)dev << 40 ^ (uint64_t)dev >> 24) *
+        UINT64_C(0x9E3779B97F4A7C15);
+
+    return h >> (64 - mh->links_bits);
+}
+
+static size_t
+multihash_link_slot(Multihash *mh, dev_t dev, const uint64_t *key,
+    int clone)
+{
+    size_t mask = ((size_t)1 << mh->links_bits) - 1, i;
+    Multihash_link *link;
+
+    for (i = multihash_link_home(mh, dev, key);
+         (link = mh->links[i]) != NULL; i = (i + 1) & mask)
+        if (link->dev == dev && link->key[0] == key[0] &&
+            link->key[1] == key[1] && link->clone == clone)
+            break;
+    return i;
+}
+
+/* keep the table at most half full */
+static void
+multihash_link_grow(Multihash *mh)
+{
+    Multihash_link **old = mh->links;
+    size_t old_size = old == NULL ? 0 : (size_t)1 << mh->links_bits, i;
+
+    if ((mh->nb_links + 1) * 2 <= old_size)
+        return;
+    mh->links_bits = old == NULL ? 10 : mh->links_bits + 1;
+    mh->links = calloc((size_t)1 << mh->links_bits, sizeof(*mh->links));
+    if (mh->links == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < old_size; i++)
+        if (old[i] != NULL)
+            mh->links[multihash_link_slot(mh, old[i]->dev, old[i]->key,
+                old[i]->clone)] = old[i];
+    free(old);
+}
+
+/* move back the following entries that can no longer be found */
+static void
+multihash_link_remove(Multihash *mh, Multihash_link *link)
+{
+    size_t mask = ((size_t)1 << mh->links_bits) - 1, i, j, k;
+
+    i = multihash_link_slot(mh, link->dev, link->key, link->clone);
+    mh->links[i] = NULL;
+    for (j = (i + 1) & mask; mh->links[j] != NULL; j = (j + 1) & mask) {
+        k = multihash_link_home(mh, mh->links[j]->dev, mh->links[j]->key);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            mh->links[i] = mh->links[j];
+            mh->links[j] = NULL;
+            i = j;
+        }
+    }
+    mh->nb_links--;
+    link->in_table = 0;
+}
+
+/* called by the walk for the regular files with several links or shared
+   extents */
+static void
+multihash_link_add(Multihash *mh, Multihash_job *job, const uint64_t *key,
+    int clone)
+{
+    Multihash_link *link;
+    size_t i;
+
+    pthread_mutex_lock(&mh->links_mutex);
+    multihash_link_grow(mh);
+    i = multihash_link_slot(mh, job->st.st_dev, key, clone);
+    link = mh->links[i];
+    if (link == NULL) {
+        link = malloc(sizeof(*link) + mh->link_out_size);
+        if (link == NULL || (link->path = strdup(job->rel_path)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        link->dev = job->st.st_dev;
+        link->key[0] = key[0];
+        link->key[1] = key[1];
+        link->left = clone ? 0 : job->st.st_nlink - 1;
+        link->refs = 1;
+        link->in_table = 1;
+        link->clone = clone;
+        mh->links[i] = link;
+        mh->nb_links++;
+        job->link_first = 1;
+    } else {
+        link->refs++;
+        if (link->left > 0 && --link->left == 0)
+            multihash_link_remove(mh, link);
+    }
+    job->link = link;
+    pthread_mutex_unlock(&mh->links_mutex);
+}
+
+/* jobs are output in order, so the first path is output first */
+static void
+multihash_link_digests(Multihash *mh, Multihash_job *job)
+{
+    uint8_t *out = job->link->out;
+    unsigned i;
+
+    for (i = 0; i < mh->nb_hashes; i++) {
+        if (job->link_first) {
+            memcpy(out, job->hi[i].out, job->hi[i].size);
+        } else {
+            memcpy(job->hi[i].out, out, job->hi[i].size);
+            /* not hashed for this path */
+            job->hi[i].disabled = 1;
+        }
+        out += job->hi[i].size;
+    }
+}
+
+static void
+multihash_link_free(Multihash_link *link)
+{
+    free(link->path);
+    free(link);
+}
+
+static void
+multihash_link_release(Multihash *mh, Multihash_link *link)
+{
+    int unused;
+
+    pthread_mutex_lock(&mh->links_mutex);
+    unused = --link->refs == 0 && !link->in_table;
+    pthread_mutex_unlock(&mh->links_mutex);
+    if (unused)
+        multihash_link_free(link);
+}
+
+static void
+multihash_job_emit(Multihash *mh, Multihash_job *job)
+{
+    const struct stat *st = &job->st;
+
+    if (mh->formatter == NULL) {
+        if (job->ret == 0) {
+            multihash_output(mh, job->hi, job->index, job->path);
+            multihash_verbose(mh, job->hi);
+            fflush(stdout);
+        } else {
+            mh->errors++;
+        }
+    } else if (!mh->failed) {
+        multihash_file_stat(mh, job->rel_path, job->type, job->data,
+            st->st_size, job->target, st->st_mtime, st->st_mode);
+        if (job->data && job->ret != 0) {
+            /* the walk stops, but the entry and the output stay valid */
+            mh->failed = 1;
+        } else if (job->data) {
+            if (job->link != NULL)
+                multihash_link_digests(mh, job);
+            if (job->block_mode) {
+                multihash_output_blocks(mh, job);
+            } else {
+                multihash_output(mh, job->hi, 0, NULL);
+                multihash_verbose(mh, job->hi);
+            }
+            if (job->link != NULL && !job->link_first) {
+                formatter_dict_item(mh->formatter,
+                    job->link->clone ? "clone_of" : "link_of");
+                formatter_string(mh->formatter, job->link->path);
+            }
+        }
+        if (job->subtree_skipped) {
+            formatter_dict_item(mh->formatter, "subtree_skipped");
+            formatter_bool(mh->formatter, 1);
+        }
+        formatter_dict_close(mh->formatter);
+    }
+    if (job->link != NULL)
+        multihash_link_release(mh, job->link);
+    multihash_job_free(job);
+}
+
+static void
+multihash_job_output(void *mh_v, void *job_v)
+{
+    Multihash *mh = mh_v;
+    Multihash_job *job = job_v;
+
+    if (mh->reorder == NULL) {
+        multihash_job_emit(mh, job);
+        return;
+    }
+    /* a group is submitted entirely before the next one: its jobs have
+       distinct slots */
+    mh->reorder[job->seq % PHYSICAL_WINDOW] = job;
+    while ((job = mh->reorder[mh->reorder_next % PHYSICAL_WINDOW]) != NULL) {
+        mh->reorder[mh->reorder_next % PHYSICAL_WINDOW] = NULL;
+        mh->reorder_next++;
+        multihash_job_emit(mh, job);
+    }
+}
+
+static char *
+multihash_strdup(const char *str)
+{
+    char *r;
+
+    if (str == NULL)
+        return NULL;
+    r = strdup(str);
+    if (r == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return r;
+}
+
+static unsigned
+multihash_device_queue(Multihash *mh, dev_t dev)
+{
+    unsigned i;
+
+    for (i = 0; i < mh->nb_devices; i++)
+        if (mh->devices[i] == dev)
+            return i;
+    if (mh->nb_devices < DEVICE_QUEUES)
+        mh->devices[mh->nb_devices++] = dev;
+    return i;
+}
+
+static void
+multihash_job_submit(Multihash *mh, Multihash_job *job)
+{
+    const struct stat *st = &job->st;
+    unsigned queue = 0;
+
+    /* the cache is bypassed for the large files with -D, and reading in
+       advance would escape the throttle */
+    if ((job->flags & SCHEDULER_PROCESS) && S_ISREG(st->st_mode) &&
+        st->st_size > 0 &&
+        (st->st_size <= SMALL_FILE_SIZE || !mh->opt.direct) &&
+        mh->throttle == NULL)
+        multihash_lookahead_queue(mh, job);
+    if (mh->opt.device_jobs != 0 && job->data)
+        queue = multihash_device_queue(mh, st->st_dev);
+    scheduler_submit_queue(mh->sched, job, job->flags, queue);
+}
+
+static int
+compare_physical(const void *a_v, const void *b_v)
+{
+    const Multihash_job *a = *(const Multihash_job **)a_v;
+    const Multihash_job *b = *(const Multihash_job **)b_v;
+
+    if (a->st.st_dev != b->st.st_dev)
+        return a->st.st_dev < b->st.st_dev ? -1 : 1;
+    if (a->physical != b->physical)
+        return a->physical < b->physical ? -1 : 1;
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static void
+multihash_physical_flush(Multihash *mh)
+{
+    unsigned i;
+
+    qsort(mh->physical, mh->nb_physical, sizeof(*mh->physical),
+        compare_physical);
+    for (i = 0; i < mh->nb_physical; i++)
+        multihash_job_submit(mh, mh->physical[i]);
+    mh->nb_physical = 0;
+}
+
+static void
+multihash_physical_add(Multihash *mh, Multihash_job *job)
+{
+    job->seq = mh->walk_seq++;
+    /* files the file system cannot locate come last, in walk order */
+    job->physical = 0;
+    if ((job->flags & SCHEDULER_PROCESS) &&
+        extents_first_physical(job->fd, &job->physical) < 0)
+        job->physical = UINT64_MAX;
+    mh->physical[mh->nb_physical++] = job;
+    if (mh->nb_physical == PHYSICAL_WINDOW)
+        multihash_physical_flush(mh);
+}
+
 static int
 multihash_tree_file(Multihash *mh, Treewalk *tw)
 {
-    const char *rel_path, *target = NULL;
+    Multihash_job *job;
+    const char *rel_path;
     const struct stat *st;
     const char *type;
-    char *full_path;
+    uint64_t key[2];
     size_t len1, len2;
-    int ret = 0, fd;
+    int fd;
 
     rel_path = treewalk_get_path(tw);
     st = treewalk_get_stat(tw);
@@ -279,27 +1756,61 @@ multihash_tree_file(Multihash *mh, Treewalk *tw)
         fprintf(stderr, "unknown type\n");
         return -1;
     }
+    job = multihash_job_alloc(mh);
     len1 = strlen(mh->rec_root);
     len2 = strlen(rel_path);
-    full_path = malloc(len1 + len2 + 1);
-    if (full_path == NULL)
+    job->path = malloc(len1 + len2 + 1);
+    if (job->path == NULL) {
+        multihash_job_free(job);
         return -1;
-    memcpy(full_path, mh->rec_root, len1);
-    memcpy(full_path + len1, rel_path, len2 + 1);
+    }
+    memcpy(job->path, mh->rec_root, len1);
+    memcpy(job->path + len1, rel_path, len2 + 1);
+    job->rel_path = multihash_strdup(rel_path);
     if (S_ISLNK(st->st_mode))
-        target = treewalk_readlink(tw);
-
-    multihash_file_stat(mh, rel_path, type, fd >= 0, st->st_size, target,
-        st->st_mtime, st->st_mode);
-    if (fd >= 0)
-        ret = multihash_file(mh, 0, full_path, fd);
-    if (treewalk_get_subtree_skipped(tw)) {
-        formatter_dict_item(mh->formatter, "subtree_skipped");
-        formatter_bool(mh->formatter, 1);
+        job->target = multihash_strdup(treewalk_readlink(tw));
+    job->type = type;
+    job->st = *st;
+    job->subtree_skipped = treewalk_get_subtree_skipped(tw);
+    if (fd >= 0) {
+        /* the walker closes its descriptor when it moves on */
+        job->fd = dup(fd);
+        if (job->fd < 0) {
+            perror("dup");
+            multihash_job_free(job);
+            return -1;
+        }
+        job->data = 1;
     }
-    formatter_dict_close(mh->formatter);
-    free(full_path);
-    return ret == 0 ? 0 : -1;
+    job->flags = 0;
+    if (job->data) {
+        job->flags |= SCHEDULER_PROCESS;
+        if (S_ISREG(st->st_mode) && st->st_size <= SMALL_FILE_SIZE)
+            job->flags |= SCHEDULER_BATCH;
+        if (mh->opt.block_size != 0 && S_ISREG(st->st_mode) &&
+            (uint64_t)st->st_size > mh->opt.block_size)
+            job->block_mode = 1;
+        if (S_ISREG(st->st_mode) && st->st_nlink > 1 && !job->block_mode) {
+            key[0] = st->st_ino;
+            key[1] = 0;
+            multihash_link_add(mh, job, key, 0);
+        }
+        if (mh->opt.extents && job->link == NULL && S_ISREG(st->st_mode) &&
+            st->st_size > 0 && !job->block_mode &&
+            extents_fingerprint(job->fd, st->st_size, (uint8_t *)key) > 0)
+            multihash_link_add(mh, job, key, 1);
+        if (job->link != NULL && !job->link_first) {
+            /* the digests of the first path are used */
+            job->flags = 0;
+            close(job->fd);
+            job->fd = -1;
+        }
+    }
+    if (mh->physical != NULL)
+        multihash_physical_add(mh, job);
+    else
+        multihash_job_submit(mh, job);
+    return 0;
 }
 
 static int report_write_error(int err)
@@ -348,16 +1859,25 @@ multihash_tree(Multihash *mh)
         return 1;
     treewalk_set_follow(tw, mh->opt.follow);
     treewalk_set_exclude(tw, mh->opt.exclude, mh->opt.nb_exclude);
+    treewalk_set_threads(tw, mh->opt.walk_threads);
+    treewalk_set_dont_sync(tw, mh->opt.dont_sync);
     while (1) {
         ret = multihash_tree_file(mh, tw);
         if (ret < 0)
             break;
+        if (mh->failed) {
+            ret = -1;
+            break;
+        }
         ret = treewalk_next(tw);
         if (ret <= 0)
             break;
     }
+    if (mh->physical != NULL)
+        multihash_physical_flush(mh);
+    scheduler_flush(mh->sched);
     treewalk_free(&tw);
-    return ret < 0;
+    return ret < 0 || mh->failed;
 }
 
 typedef struct Stream_archive {
@@ -373,10 +1893,8 @@ static unsigned stream_archive_fill_buffer(Stream *s,
 
     assert(niov >= 1);
     r = archive_read(s2->ar, iov[0].iov_base, iov[0].iov_len);
-    if (r < 0) {
-        perror("read");
+    if (r < 0)
         exit(1);
-    }
     return r;
 }
 
@@ -392,6 +1910,7 @@ static void
 multihash_tar_file(Multihash *mh, Archive_reader *ar)
 {
     Stream_archive s = stream_archive(ar);
+    Multihash_job *job;
     char type[2] = { ar->type, 0 };
     char *target;
     int data;
@@ -403,7 +1922,11 @@ multihash_tar_file(Multihash *mh, Archive_reader *ar)
         ar->mtime, ar->mode);
     if (data) {
         multihash_stream_data(mh->ph, &s.stream);
-        multihash_output(mh, 0, NULL);
+        job = multihash_job_alloc(mh);
+        multihash_collect(mh, mh->ph, job->hi);
+        multihash_output(mh, job->hi, 0, NULL);
+        multihash_verbose(mh, job->hi);
+        multihash_job_free(job);
     }
     formatter_dict_close(mh->formatter);
 }
@@ -414,7 +1937,8 @@ multihash_tar(Multihash *mh)
     Archive_reader *ar;
     int errors = 0, ret;
 
-    ret = archive_open(&ar, stdin);
+    pipe_grow(0);
+    ret = archive_open(&ar, 0);
     if (ret < 0) {
         perror("archive_open");
         return 1;
@@ -450,19 +1974,74 @@ opt_add_exclude(struct Multihash_options *opt, const char *excl)
     opt->nb_exclude++;
 }
 
+/*
+ * Parse a size with an optional k, M or G binary suffix; returns 0 if
+ * invalid.
+ */
+static size_t
+parse_size(const char *str)
+{
+    unsigned long long r;
+    char *end;
+
+    r = strtoull(str, &end, 10);
+    if (end == str)
+        return 0;
+    switch (*end) {
+        case 'k': r <<= 10; end++; break;
+        case 'M': r <<= 20; end++; break;
+        case 'G': r <<= 30; end++; break;
+    }
+    return *end == 0 && r <= SIZE_MAX ? r : 0;
+}
+
+/*
+ * Put the process, and the threads it creates afterwards, in the idle
+ * I/O class: the disk only serves it when nobody else needs it.
+ */
+static void
+set_idle_io_priority(void)
+{
+#ifdef __linux__
+    /* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT */
+    if (syscall(SYS_ioprio_set, 1, 0, 3 << 13) < 0) {
+        perror("ioprio_set");
+        exit(1);
+    }
+#else
+    fprintf(stderr, "multihash: idle I/O priority not supported\n");
+    exit(1);
+#endif
+}
+
 static void
 usage(int ret)
 {
     fprintf(ret == 0 ? stdout : stderr,
-        "Usage: multihash [options] files\n"
+        "Usage: multihash [options] files (- for stdin)\n"
         "\n"
         "Options:\n"
+        "    -A : hash only the data appended to large files\n"
+        "    -B : hash files larger than size by blocks (with -r)\n"
         "    -C : disable caching\n"
+        "    -D : read large files with direct I/O, bypassing the page cache\n"
+        "    -E : hash files sharing all their extents once (with -r)\n"
+        "    -H : comma-separated list of hashes to compute\n"
+        "    -J : number of files of the same device to hash in parallel\n"
         "    -L : follow symbolic links\n"
+        "    -O : maximum number of reads per second\n"
+        "    -P : read files in physical order (with -r)\n"
+        "    -R : maximum number of bytes read per second\n"
+        "    -S : use attributes cached by network file systems (with -r)\n"
+        "    -T : number of threads sharing the hashes of a file\n"
+        "    -i : read with the idle I/O priority\n"
+        "    -j : number of files to hash in parallel\n"
+        "    -n : lower the CPU priority by this niceness\n"
         "    -r : process files recursively\n"
         "    -s : script-friendly output\n"
         "    -t : process tar archive from stdin\n"
         "    -v : verbose output\n"
+        "    -w : number of threads scanning the directories (with -r)\n"
         "    -x : exclude path in recursive mode\n"
         "    -h : print this help\n"
         "\n"
@@ -474,25 +2053,146 @@ int
 main(int argc, char **argv)
 {
     Multihash multihash, *mh = &multihash;
+    Multihash_worker *w;
+    Parhash_info *hi;
+    Multihash_job *job;
+    unsigned window;
+    long nb_cpu;
+    size_t j;
     int ret, opt, i, errors = 0;
+    char *end;
 
+    mh->ph = NULL;
+    mh->workers = NULL;
+    mh->sched = NULL;
+    mh->throttle = NULL;
+    mh->lookahead = NULL;
+    mh->physical = NULL;
+    mh->reorder = NULL;
+    mh->links = NULL;
+    mh->nb_links = 0;
     mh->formatter = NULL;
+    mh->errors = 0;
+    mh->failed = 0;
+    mh->total = NULL;
+    mh->nb_files = 0;
+    mh->start_time = multihash_clock();
+    mh->opt.jobs = 1;
+    mh->opt.device_jobs = 0;
+    mh->opt.walk_threads = 0;
+    mh->opt.dont_sync = 0;
+    mh->opt.extents = 0;
+    mh->opt.threads = 0;
+    mh->opt.block_size = 0;
+    mh->opt.max_rate = 0;
+    mh->opt.max_reads = 0;
+    mh->opt.nice = 0;
+    mh->opt.idle = 0;
+    mh->opt.append = 0;
     mh->opt.no_cache = 0;
     mh->opt.follow = 0;
     mh->opt.recursive = 0;
     mh->opt.archive = 0;
     mh->opt.script = 0;
     mh->opt.verbose = 0;
+    mh->opt.direct = 0;
+    mh->opt.no_mmap = getenv("MULTIHASH_NO_MMAP") != NULL;
+    mh->opt.physical = 0;
     mh->opt.exclude = NULL;
     mh->opt.nb_exclude = 0;
-    while ((opt = getopt(argc, argv, "CLrstvx:h")) != -1) {
+    mh->opt.hashes = NULL;
+    while ((opt = getopt(argc, argv,
+        "AB:CDEH:J:LO:PR:ST:ij:n:rstvw:x:h")) != -1) {
         switch (opt) {
+            case 'A':
+                mh->opt.append = 1;
+                break;
+            case 'B':
+                mh->opt.block_size = parse_size(optarg);
+                if (mh->opt.block_size < 4096 ||
+                    mh->opt.block_size > (1 << 30)) {
+                    fprintf(stderr, "multihash: invalid block size: %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
             case 'C':
                 mh->opt.no_cache = 1;
                 break;
+            case 'D':
+                mh->opt.direct = 1;
+                break;
+            case 'E':
+                mh->opt.extents = 1;
+                break;
+            case 'H':
+                mh->opt.hashes = optarg;
+                break;
+            case 'J':
+                mh->opt.device_jobs = strtoul(optarg, &end, 10);
+                if (*optarg == 0 || *end != 0 ||
+                    mh->opt.device_jobs < 1 || mh->opt.device_jobs > 256) {
+                    fprintf(stderr, "multihash: invalid number of jobs: %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
             case 'L':
                 mh->opt.follow = 1;
                 break;
+            case 'O':
+                mh->opt.max_reads = strtoul(optarg, &end, 10);
+                if (*optarg == 0 || *end != 0 ||
+                    mh->opt.max_reads < 1 || mh->opt.max_reads > 1000000) {
+                    fprintf(stderr, "multihash: invalid read rate: %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                mh->opt.physical = 1;
+                break;
+            case 'R':
+                mh->opt.max_rate = parse_size(optarg);
+                if (mh->opt.max_rate == 0) {
+                    fprintf(stderr, "multihash: invalid byte rate: %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                mh->opt.dont_sync = 1;
+                break;
+            case 'T':
+                mh->opt.threads = strtoul(optarg, &end, 10);
+                if (*optarg == 0 || *end != 0 ||
+                    mh->opt.threads < 1 || mh->opt.threads > 256) {
+                    fprintf(stderr,
+                        "multihash: invalid number of threads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'i':
+                mh->opt.idle = 1;
+                break;
+            case 'j':
+                mh->opt.jobs = strtoul(optarg, &end, 10);
+                if (*optarg == 0 || *end != 0 ||
+                    mh->opt.jobs < 1 || mh->opt.jobs > 256) {
+                    fprintf(stderr, "multihash: invalid number of jobs: %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                mh->opt.nice = strtol(optarg, &end, 10);
+                if (*optarg == 0 || *end != 0 ||
+                    mh->opt.nice < 1 || mh->opt.nice > 19) {
+                    fprintf(stderr, "multihash: invalid niceness: %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
             case 'r':
                 mh->opt.recursive = 1;
                 break;
@@ -505,6 +2205,15 @@ main(int argc, char **argv)
             case 'v':
                 mh->opt.verbose = 1;
                 break;
+            case 'w':
+                mh->opt.walk_threads = strtoul(optarg, &end, 10);
+                if (*optarg == 0 || *end != 0 ||
+                    mh->opt.walk_threads < 1 || mh->opt.walk_threads > 256) {
+                    fprintf(stderr,
+                        "multihash: invalid number of threads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
             case 'x':
                 opt_add_exclude(&mh->opt, optarg);
                 break;
@@ -519,10 +2228,133 @@ main(int argc, char **argv)
     argv += optind;
     if (argc == 0 && !mh->opt.archive)
         usage(1);
-    if (parhash_alloc(&mh->ph) < 0)
+    if (mh->opt.block_size != 0 && !mh->opt.recursive) {
+        fprintf(stderr, "multihash: block mode requires -r\n");
+        exit(1);
+    }
+    if (mh->opt.physical && !mh->opt.recursive) {
+        fprintf(stderr, "multihash: physical order requires -r\n");
+        exit(1);
+    }
+    if (mh->opt.extents && !mh->opt.recursive) {
+        fprintf(stderr, "multihash: shared extents require -r\n");
+        exit(1);
+    }
+    if (mh->opt.dont_sync && !mh->opt.recursive) {
+        fprintf(stderr, "multihash: cached attributes require -r\n");
+        exit(1);
+    }
+    if (mh->opt.walk_threads != 0 && !mh->opt.recursive) {
+        fprintf(stderr, "multihash: directory threads require -r\n");
+        exit(1);
+    }
+    if (mh->opt.device_jobs != 0 && !mh->opt.recursive) {
+        fprintf(stderr, "multihash: per-device jobs require -r\n");
+        exit(1);
+    }
+    /* before creating the threads, which inherit the priorities */
+    if (mh->opt.idle)
+        set_idle_io_priority();
+    if (mh->opt.nice != 0) {
+        errno = 0;
+        if (nice(mh->opt.nice) == -1 && errno != 0) {
+            perror("nice");
+            exit(1);
+        }
+    }
+    if ((mh->opt.max_rate != 0 || mh->opt.max_reads != 0) &&
+        throttle_alloc(&mh->throttle, mh->opt.max_rate,
+            mh->opt.max_reads) < 0)
+        exit(1);
+    if (mh->opt.archive) {
+        if (parhash_alloc(&mh->ph, mh->opt.hashes, mh->opt.threads) < 0)
+            exit(1);
+    } else {
+        mh->workers = calloc(mh->opt.jobs, sizeof(*mh->workers));
+        if (mh->workers == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (i = 0; i < (int)mh->opt.jobs; i++) {
+            if (parhash_alloc(&mh->workers[i].ph, mh->opt.hashes,
+                mh->opt.threads) < 0)
+                exit(1);
+            /* without io_uring, files are read with readv() */
+            if (getenv("MULTIHASH_NO_URING") == NULL)
+                uring_alloc(&mh->workers[i].uring, URING_DEPTH);
+        }
+        mh->batch = parhash_batch_size(mh->workers[0].ph);
+        nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+        mh->block_threads = nb_cpu > 0 ? nb_cpu : 1;
+        window = mh->opt.jobs * (WINDOW_PER_JOB + mh->batch);
+        if (window > WINDOW_MAX)
+            window = WINDOW_MAX;
+        for (i = 0; i < (int)mh->opt.jobs; i++) {
+            w = &mh->workers[i];
+            w->batch_buf = malloc(BATCH_BUF_SIZE);
+            w->batch_jobs = malloc(mh->batch * sizeof(*w->batch_jobs));
+            w->batch_data = malloc(mh->batch * sizeof(*w->batch_data));
+            w->batch_size = malloc(mh->batch * sizeof(*w->batch_size));
+            w->batch_hi = malloc(mh->batch * sizeof(*w->batch_hi));
+            if (w->batch_buf == NULL || w->batch_jobs == NULL ||
+                w->batch_data == NULL || w->batch_size == NULL ||
+                w->batch_hi == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            w->batch_used = 0;
+            w->nb_batch = 0;
+        }
+        if (scheduler_alloc(&mh->sched, mh->opt.jobs, window, mh->batch,
+            multihash_job_process, multihash_job_output, mh) < 0)
+            exit(1);
+        mh->nb_devices = 0;
+        if (mh->opt.device_jobs != 0 &&
+            scheduler_set_queues(mh->sched, DEVICE_QUEUES,
+                mh->opt.device_jobs) < 0)
+            exit(1);
+        if (mh->opt.recursive) {
+            /* one more for the job submitted while the window is full */
+            mh->lookahead_alloc = window + 1;
+            mh->lookahead = malloc(mh->lookahead_alloc *
+                sizeof(*mh->lookahead));
+            if (mh->lookahead == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            mh->lookahead_head = mh->lookahead_tail = 0;
+            pthread_mutex_init(&mh->lookahead_mutex, NULL);
+        }
+        if (mh->opt.physical) {
+            mh->physical = malloc(PHYSICAL_WINDOW * sizeof(*mh->physical));
+            mh->reorder = calloc(PHYSICAL_WINDOW, sizeof(*mh->reorder));
+            if (mh->physical == NULL || mh->reorder == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            mh->nb_physical = 0;
+            mh->walk_seq = mh->reorder_next = 0;
+        }
+    }
+    for (mh->nb_hashes = 0;
+         (hi = parhash_get_info(mh->ph != NULL ? mh->ph : mh->workers[0].ph,
+            mh->nb_hashes)) != NULL;
+         mh->nb_hashes++);
+    mh->total = calloc(mh->nb_hashes, sizeof(*mh->total));
+    if (mh->total == NULL) {
+        perror("malloc");
         exit(1);
+    }
+    mh->link_out_size = 0;
+    for (i = 0; i < (int)mh->nb_hashes; i++) {
+        hi = parhash_get_info(mh->ph != NULL ? mh->ph : mh->workers[0].ph, i);
+        mh->total[i].name = hi->name;
+        mh->link_out_size += hi->size;
+    }
+    pthread_mutex_init(&mh->links_mutex, NULL);
     if (stat_cache_alloc(&mh->cache) < 0)
         exit(1);
+    pthread_mutex_init(&mh->cache_mutex, NULL);
     if (mh->opt.recursive) {
         if (argc != 1) {
             fprintf(stderr, "multihash: only one path allowed in "
@@ -546,13 +2378,53 @@ main(int argc, char **argv)
         errors += multihash_tar(mh);
         errors += formatted_output_finish(mh);
     } else {
-        for (i = 0; i < argc; i++)
-            errors += multihash_file(mh, i, argv[i], -1);
+        for (i = 0; i < argc; i++) {
+            job = multihash_job_alloc(mh);
+            job->index = i;
+            job->path = multihash_strdup(argv[i]);
+            scheduler_submit(mh->sched, job, SCHEDULER_PROCESS);
+        }
+        scheduler_flush(mh->sched);
+        errors += mh->errors;
         fflush(stdout);
         errors += report_write_error(ferror(stdout));
     }
+    multihash_verbose_total(mh);
+    if (mh->sched != NULL)
+        scheduler_free(&mh->sched);
+    if (mh->lookahead != NULL) {
+        free(mh->lookahead);
+        pthread_mutex_destroy(&mh->lookahead_mutex);
+    }
+    free(mh->physical);
+    free(mh->reorder);
+    /* the files with links outside the tree are left */
+    for (j = 0; mh->links != NULL && j < (size_t)1 << mh->links_bits; j++)
+        if (mh->links[j] != NULL)
+            multihash_link_free(mh->links[j]);
+    free(mh->links);
+    pthread_mutex_destroy(&mh->links_mutex);
+    if (mh->throttle != NULL)
+        throttle_free(&mh->throttle);
+    if (mh->workers != NULL) {
+        for (i = 0; i < (int)mh->opt.jobs; i++) {
+            w = &mh->workers[i];
+            parhash_free(&w->ph);
+            if (w->uring != NULL)
+                uring_free(&w->uring);
+            free(w->batch_buf);
+            free(w->batch_jobs);
+            free(w->batch_data);
+            free(w->batch_size);
+            free(w->batch_hi);
+        }
+        free(mh->workers);
+    }
+    if (mh->ph != NULL)
+        parhash_free(&mh->ph);
+    pthread_mutex_destroy(&mh->cache_mutex);
     stat_cache_free(&mh->cache);
-    parhash_free(&mh->ph);
+    free(mh->total);
     free(mh->opt.exclude);
     return errors > 0;
 }
@@ -12,18 +12,51 @@
  * See the GNU General Public License for more details.
  */
 
-#define _GNU_SOURCE /* for RUSAGE_THREAD */
+#define _GNU_SOURCE /* for RUSAGE_THREAD and syscall() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include <openssl/crypto.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
 #include "parhash.h"
+#include "crc32.h"
+#include "mbhash.h"
+#include "blake3.h"
+#include "xxh3.h"
 
 #define BUF_SIZE (4 * 1024 * 1024) /* power of 2 needed */
+/* Alignment of the buffer and of the start of the streams, for O_DIRECT */
+#define BUF_ALIGN 4096
+
+/* Block processed by all the hashes of a thread in turn, fits in L2 */
+#define STITCH_BLOCK (256 * 1024)
+
+/* Updates on mapped files are small enough to stay in the hashing
+   thread, where a SIGBUS can be caught */
+#define MAPPED_CHUNK (256 * 1024)
+/* Mapped data given to the hashes at once, and advised ahead */
+#define MAPPED_WINDOW (1024 * 1024)
+
+/* Zeros fed at once to the hashes without a shortcut for them */
+#define ZERO_CHUNK (64 * 1024)
+
+/* Number of buffers handed to the multi-buffer code at once */
+#define MB_CHUNK 64
 
 enum Hash_function {
     HASH_CRC32,
@@ -31,65 +64,192 @@ enum Hash_function {
     HASH_SHA1,
     HASH_SHA256,
     HASH_SHA512,
+    HASH_BLAKE3,
+    HASH_XXH128,
     NB_HASH,
 };
 
+/* The hashes computed when no list is given */
+#define DEFAULT_HASHES ((1 << (HASH_SHA512 + 1)) - 1)
+
+/* to increase when the layout of the states of the included hashes
+   changes */
+#define STATE_FORMAT 1
+
 typedef union Hash_state {
     unsigned crc32;
     MD5_CTX md5;
     SHA_CTX sha1;
     SHA256_CTX sha256;
     SHA512_CTX sha512;
+    Blake3_state blake3;
+    Xxh3_state xxh128;
 } Hash_state;
 
-typedef struct Hash_context {
-    Parhash_info pub;
-    unsigned buf_fill;
-    uint8_t eof;
-    uint8_t started;
-    Parhash *parhash;
-    pthread_t thread;
+#define CACHE_ALIGNED __attribute__((aligned(64)))
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define LOAD_SC(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE_SC(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+/*
+ * Sleeping point for a single waiter. The waiter announces itself with
+ * event_prepare(), re-checks its condition and then calls event_wait();
+ * the other side makes its change visible and calls event_signal(), which
+ * only costs a load when nobody is sleeping.
+ */
+typedef struct Parhash_event {
+    unsigned seq;
+    unsigned waiting;
+#ifndef __linux__
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+#endif
+} Parhash_event;
+
+typedef struct Hash_algo {
+    const char *name;
+    unsigned size;
     void (*init)(Hash_state *);
     void (*update)(Hash_state *, const uint8_t *, size_t);
     void (*final)(Hash_state *, uint8_t *, size_t);
+    int mbhash; /* enum Mbhash_function, or -1 */
+    void (*zero)(Hash_state *, uint64_t); /* update with zeros, optional */
+} Hash_algo;
+
+typedef struct Hash_context {
+    Parhash_info pub;
+    const Hash_algo *algo;
+    Hash_state saved; /* state before finalization, or to resume from */
+    uint8_t resume;
 } Hash_context;
 
+/*
+ * The ring is shared by one producer and the consumer threads.
+ * Positions are byte counts since the allocation of the Parhash, only
+ * the producer writes wpos and only each consumer writes its own rpos.
+ * A consumer runs one hash, or several in turn on each block in stitched
+ * mode.
+ */
+typedef struct Hash_thread {
+    uint64_t rpos CACHE_ALIGNED;
+    Parhash_event event;
+    unsigned stream;
+    unsigned stream_done;
+    uint8_t started;
+    uint8_t quit;
+    uint8_t has_thread;
+    uint64_t stall_usec;
+    Parhash *parhash;
+    pthread_t thread;
+    Hash_context *ctx[NB_HASH];
+    unsigned nb_ctx;
+} Hash_thread;
+
 struct Parhash {
+    uint64_t wpos CACHE_ALIGNED;
+    unsigned eof;
+    Parhash_event event;
     Hash_context ctx[NB_HASH];
-    unsigned pos;
+    unsigned nb_ctx;
+    Hash_thread thread[NB_HASH];
+    unsigned nb_threads;
+    unsigned block;
+    unsigned stream;
     unsigned avail;
-    uint8_t buf[BUF_SIZE];
+    /* data of the stream when hashing a mapped file instead of the buffer */
+    const uint8_t *ext;
+    uint64_t ext_start;
+    unsigned ext_failed;
+    /* the stream up to there is a run of zeros not in the buffer */
+    uint64_t zero_end;
+    uint8_t buf[BUF_SIZE] __attribute__((aligned(BUF_ALIGN)));
 };
 
-static uint32_t crc32_table[256];
+static void
+event_init(Parhash_event *ev)
+{
+    ev->seq = 0;
+    ev->waiting = 0;
+#ifndef __linux__
+    pthread_mutex_init(&ev->mutex, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+#endif
+}
 
 static void
-crc32_init(Hash_state *s)
+event_uninit(Parhash_event *ev)
+{
+#ifndef __linux__
+    pthread_mutex_destroy(&ev->mutex);
+    pthread_cond_destroy(&ev->cond);
+#else
+    (void)ev;
+#endif
+}
+
+static unsigned
+event_prepare(Parhash_event *ev)
 {
-    unsigned i, j, c;
-    const unsigned base = 0xEDB88320;
+    unsigned seq = LOAD(ev->seq);
+
+    STORE_SC(ev->waiting, 1);
+    return seq;
+}
+
+static void
+event_cancel(Parhash_event *ev)
+{
+    STORE(ev->waiting, 0);
+}
 
+static void
+event_wait(Parhash_event *ev, unsigned seq)
+{
+#ifdef __linux__
+    syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&ev->mutex);
+    while (LOAD(ev->seq) == seq)
+        pthread_cond_wait(&ev->cond, &ev->mutex);
+    pthread_mutex_unlock(&ev->mutex);
+#endif
+    STORE(ev->waiting, 0);
+}
+
+static void
+event_signal(Parhash_event *ev)
+{
+    if (!LOAD_SC(ev->waiting))
+        return;
+#ifdef __linux__
+    __atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&ev->mutex);
+    __atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&ev->cond);
+    pthread_mutex_unlock(&ev->mutex);
+#endif
+}
+
+static void
+crc32_init(Hash_state *s)
+{
     s->crc32 = 0xFFFFFFFF;
-    if (crc32_table[1] == 0) {
-        for (i = 0; i < 256; i++) {
-            c = i;
-            for (j = 0; j < 8; j++)
-                c = (c >> 1) ^ ((c & 1) ? base : 0);
-            crc32_table[i] = c;
-        }
-    }
 }
 
 static void
-crc32_update(Hash_state *s, const uint8_t *buf, size_t size)
+crc32_update_state(Hash_state *s, const uint8_t *buf, size_t size)
 {
-    uint32_t crc = s->crc32;
+    s->crc32 = crc32_update(s->crc32, buf, size);
+}
 
-    while (size-- > 0)
-        crc = (crc >> 8) ^ crc32_table[(uint8_t)(crc ^ *(buf++))];
-    s->crc32 = crc;
+static void
+crc32_zero_state(Hash_state *s, uint64_t size)
+{
+    s->crc32 = crc32_zeros(s->crc32, size);
 }
 
 static void
@@ -126,99 +286,389 @@ OPENSSL_IMPL(sha1, SHA1);
 OPENSSL_IMPL(sha256, SHA256);
 OPENSSL_IMPL(sha512, SHA512);
 
-static void
-compute_rusage(Hash_context *ctx)
+#define NATIVE_IMPL(name, impl) \
+static void \
+name ## _init_state(Hash_state *s) \
+{ \
+    impl ## _init(&s->name); \
+} \
+static void \
+name ## _update_state(Hash_state *s, const uint8_t *buf, size_t size) \
+{ \
+    impl ## _update(&s->name, buf, size); \
+} \
+static void \
+name ## _final_state(Hash_state *s, uint8_t *out, size_t size) \
+{ \
+    (void)size; \
+    impl ## _final(&s->name, out); \
+}
+
+NATIVE_IMPL(blake3, blake3);
+NATIVE_IMPL(xxh128, xxh3);
+
+static const Hash_algo hash_algos[NB_HASH] = {
+    [HASH_CRC32 ] = { "crc32",   32 / 8,
+        crc32_init,  crc32_update_state, crc32_final,
+        -1, crc32_zero_state },
+    [HASH_MD5   ] = { "md5",    128 / 8,
+        md5_init,    md5_update,         md5_final,
+        MBHASH_MD5 },
+    [HASH_SHA1  ] = { "sha1",   160 / 8,
+        sha1_init,   sha1_update,        sha1_final,
+        MBHASH_SHA1 },
+    [HASH_SHA256] = { "sha256", 256 / 8,
+        sha256_init, sha256_update,      sha256_final,
+        MBHASH_SHA256 },
+    [HASH_SHA512] = { "sha512", 512 / 8,
+        sha512_init, sha512_update,      sha512_final,
+        -1 },
+    [HASH_BLAKE3] = { "blake3", 256 / 8,
+        blake3_init_state, blake3_update_state, blake3_final_state,
+        -1 },
+    [HASH_XXH128] = { "xxh128", 128 / 8,
+        xxh128_init_state, xxh128_update_state, xxh128_final_state,
+        -1 },
+};
+
+static uint64_t
+thread_utime(void)
 {
 #ifdef RUSAGE_THREAD
     struct rusage u;
 
     getrusage(RUSAGE_THREAD, &u);
-    ctx->pub.utime_sec = u.ru_utime.tv_sec;
-    ctx->pub.utime_msec = u.ru_utime.tv_usec;
+    return (uint64_t)u.ru_utime.tv_sec * 1000000 + u.ru_utime.tv_usec;
+#else
+    return 0;
 #endif
 }
 
-static void *
-parhash_thread(void *ctx_v)
+static uint64_t
+clock_usec(void)
 {
-    Hash_context *ctx = ctx_v;
-    Parhash *parhash = ctx->parhash;
-    Hash_state state;
-    unsigned chunk, pos = 0;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+parhash_set_utime(Hash_context *ctx, uint64_t utime)
+{
+    ctx->pub.utime_sec = utime / 1000000;
+    ctx->pub.utime_msec = utime % 1000000;
+}
+
+/*
+ * A file mapped in memory can be truncated while it is hashed, and
+ * reading past the end raises SIGBUS; the update is then abandoned.
+ */
+static __thread sigjmp_buf *sigbus_jmp;
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+
+static void
+parhash_sigbus(int sig)
+{
+    if (sigbus_jmp != NULL)
+        siglongjmp(*sigbus_jmp, 1);
+    /* not ours: crash on return */
+    signal(sig, SIG_DFL);
+}
+
+static void
+parhash_sigbus_setup(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = parhash_sigbus;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/*
+ * The signal mask is not saved, which would cost a system call for each
+ * update; SIGBUS, blocked while the handler runs, is unblocked after the
+ * jump instead.
+ */
+static int
+parhash_update_guarded(Hash_context *ctx, Hash_state *state,
+    const uint8_t *data, size_t size)
+{
+    sigjmp_buf jmp;
+    sigset_t set;
+
+    if (sigsetjmp(jmp, 0)) {
+        sigbus_jmp = NULL;
+        sigemptyset(&set);
+        sigaddset(&set, SIGBUS);
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        return -1;
+    }
+    sigbus_jmp = &jmp;
+    ctx->algo->update(state, data, size);
+    sigbus_jmp = NULL;
+    return 0;
+}
+
+static int
+parhash_update(Parhash *parhash, Hash_context *ctx, Hash_state *state,
+    const uint8_t *data, size_t size)
+{
+    if (parhash->ext != NULL)
+        return parhash_update_guarded(ctx, state, data, size);
+    ctx->algo->update(state, data, size);
+    return 0;
+}
+
+static void
+parhash_update_zero(Hash_context *ctx, Hash_state *state, uint64_t size)
+{
+    static const uint8_t zero[ZERO_CHUNK];
+    size_t chunk;
+
+    if (ctx->algo->zero != NULL) {
+        ctx->algo->zero(state, size);
+        return;
+    }
+    while (size > 0) {
+        chunk = size < ZERO_CHUNK ? size : ZERO_CHUNK;
+        ctx->algo->update(state, zero, chunk);
+        size -= chunk;
+    }
+}
 
-    ctx->init(&state);
-    pthread_mutex_lock(&ctx->mutex);
+static void
+parhash_stream(Hash_thread *th)
+{
+    Parhash *parhash = th->parhash;
+    Hash_context *active[NB_HASH];
+    Hash_state state[NB_HASH];
+    uint64_t utime[NB_HASH];
+    uint64_t start = th->rpos, rpos = start, chunk, t, t_idle, idle = 0;
+    uint64_t zero;
+    const uint8_t *data;
+    unsigned pos, seq, nb = 0, i;
+    int failed = 0;
+
+    for (i = 0; i < th->nb_ctx; i++)
+        if (!th->ctx[i]->pub.disabled)
+            active[nb++] = th->ctx[i];
+    /* with several hashes, account the time of each update separately */
+    t = thread_utime();
+    for (i = 0; i < nb; i++) {
+        if (active[i]->resume)
+            state[i] = active[i]->saved;
+        else
+            active[i]->algo->init(&state[i]);
+        utime[i] = 0;
+    }
     while (1) {
-        chunk = ctx->buf_fill;
+        chunk = LOAD(parhash->wpos) - rpos;
         if (chunk == 0) {
-            if (ctx->eof)
+            if (LOAD(parhash->eof) && LOAD(parhash->wpos) == rpos)
                 break;
-            pthread_cond_wait(&ctx->cond, &ctx->mutex);
+            seq = event_prepare(&th->event);
+            if (LOAD_SC(parhash->wpos) != rpos || LOAD_SC(parhash->eof)) {
+                event_cancel(&th->event);
+                continue;
+            }
+            t_idle = clock_usec();
+            event_wait(&th->event, seq);
+            idle += clock_usec() - t_idle;
+            continue;
+        }
+        zero = LOAD(parhash->zero_end);
+        if (rpos < zero) {
+            /* all the hashes reached the run before it was queued */
+            if (chunk > zero - rpos)
+                chunk = zero - rpos;
+            for (i = 0; i < nb; i++) {
+                parhash_update_zero(active[i], &state[i], chunk);
+                if (nb > 1) {
+                    utime[i] += thread_utime() - t;
+                    t = thread_utime();
+                }
+            }
+            rpos += chunk;
+            STORE_SC(th->rpos, rpos);
+            event_signal(&parhash->event);
             continue;
         }
-        pthread_mutex_unlock(&ctx->mutex);
-        if (chunk > sizeof(parhash->buf) - pos)
-            chunk = sizeof(parhash->buf) - pos;
-        ctx->update(&state, parhash->buf + pos, chunk);
-        pos += chunk;
-        pos &= sizeof(parhash->buf) - 1;
-        pthread_mutex_lock(&ctx->mutex);
-        ctx->buf_fill -= chunk;
-        pthread_cond_signal(&ctx->cond);
+        if (parhash->ext != NULL) {
+            data = parhash->ext + (rpos - parhash->ext_start);
+            if (chunk > MAPPED_CHUNK)
+                chunk = MAPPED_CHUNK;
+        } else {
+            pos = rpos & (sizeof(parhash->buf) - 1);
+            data = parhash->buf + pos;
+            if (chunk > sizeof(parhash->buf) - pos)
+                chunk = sizeof(parhash->buf) - pos;
+        }
+        if (chunk > parhash->block)
+            chunk = parhash->block;
+        /* after a failure, only follow the producer */
+        for (i = 0; i < nb && !failed; i++) {
+            if (parhash_update(parhash, active[i], &state[i], data, chunk) < 0)
+                failed = 1;
+            if (nb > 1) {
+                utime[i] += thread_utime() - t;
+                t = thread_utime();
+            }
+        }
+        rpos += chunk;
+        STORE_SC(th->rpos, rpos);
+        event_signal(&parhash->event);
+    }
+    for (i = 0; i < nb; i++) {
+        active[i]->saved = state[i];
+        active[i]->algo->final(&state[i], active[i]->pub.out,
+            active[i]->pub.size);
+        utime[i] += thread_utime() - t;
+        t = thread_utime();
+        parhash_set_utime(active[i], utime[i]);
+        active[i]->pub.idle_usec = idle;
+        active[i]->pub.bytes = rpos - start;
+    }
+    if (failed)
+        STORE(parhash->ext_failed, 1);
+}
+
+/*
+ * The hashing threads live as long as the Parhash; parhash_start() re-arms
+ * them for each new stream and parhash_finish() waits for them to be idle.
+ */
+static void *
+parhash_thread(void *th_v)
+{
+    Hash_thread *th = th_v;
+    unsigned stream, seq;
+
+    while (1) {
+        stream = LOAD(th->stream);
+        if (LOAD(th->quit))
+            break;
+        if (stream == th->stream_done) {
+            seq = event_prepare(&th->event);
+            if (LOAD_SC(th->stream) != stream || LOAD_SC(th->quit)) {
+                event_cancel(&th->event);
+                continue;
+            }
+            event_wait(&th->event, seq);
+            continue;
+        }
+        parhash_stream(th);
+        STORE_SC(th->stream_done, stream);
+        event_signal(&th->parhash->event);
     }
-    pthread_mutex_unlock(&ctx->mutex);
-    ctx->final(&state, ctx->pub.out, ctx->pub.size);
-    compute_rusage(ctx);
     return NULL;
 }
 
+static int
+parse_hashes(const char *hashes, unsigned *rmask)
+{
+    const char *p, *end;
+    size_t len;
+    unsigned i, mask = 0;
+
+    if (hashes == NULL) {
+        *rmask = DEFAULT_HASHES;
+        return 0;
+    }
+    for (p = hashes; *p != 0; p = *end == 0 ? end : end + 1) {
+        end = strchr(p, ',');
+        if (end == NULL)
+            end = strchr(p, 0);
+        len = end - p;
+        for (i = 0; i < NB_HASH; i++)
+            if (strlen(hash_algos[i].name) == len &&
+                memcmp(hash_algos[i].name, p, len) == 0)
+                break;
+        if (i == NB_HASH) {
+            fprintf(stderr, "multihash: unknown hash function: %.*s\n",
+                (int)len, p);
+            return -1;
+        }
+        mask |= 1 << i;
+    }
+    if (mask == 0) {
+        fprintf(stderr, "multihash: no hash function selected\n");
+        return -1;
+    }
+    *rmask = mask;
+    return 0;
+}
+
 int
-parhash_alloc(Parhash **rparhash)
+parhash_alloc(Parhash **rparhash, const char *hashes, unsigned nb_threads)
 {
     Parhash *parhash;
-    unsigned i;
+    Hash_thread *th;
+    unsigned i, mask;
 
-    parhash = malloc(sizeof(*parhash));
-    if (parhash == NULL) {
+    if (parse_hashes(hashes, &mask) < 0)
+        return -1;
+    if (posix_memalign((void **)&parhash, BUF_ALIGN,
+        sizeof(*parhash)) != 0) {
         perror("malloc");
         return -1;
     }
+    crc32_setup();
+    mbhash_setup();
+    blake3_setup();
+    xxh3_setup();
 
-    parhash->ctx[HASH_CRC32 ].pub.name = "crc32";
-    parhash->ctx[HASH_CRC32 ].pub.size = 32 / 8;
-    parhash->ctx[HASH_CRC32 ].init = crc32_init;
-    parhash->ctx[HASH_CRC32 ].update = crc32_update;
-    parhash->ctx[HASH_CRC32 ].final = crc32_final;
-
-    parhash->ctx[HASH_MD5   ].pub.name = "md5";
-    parhash->ctx[HASH_MD5   ].pub.size = 128 / 8;
-    parhash->ctx[HASH_MD5   ].init = md5_init;
-    parhash->ctx[HASH_MD5   ].update = md5_update;
-    parhash->ctx[HASH_MD5   ].final = md5_final;
-
-    parhash->ctx[HASH_SHA1  ].pub.name = "sha1";
-    parhash->ctx[HASH_SHA1  ].pub.size = 160 / 8;
-    parhash->ctx[HASH_SHA1  ].init = sha1_init;
-    parhash->ctx[HASH_SHA1  ].update = sha1_update;
-    parhash->ctx[HASH_SHA1  ].final = sha1_final;
-
-    parhash->ctx[HASH_SHA256].pub.name = "sha256";
-    parhash->ctx[HASH_SHA256].pub.size = 256 / 8;
-    parhash->ctx[HASH_SHA256].init = sha256_init;
-    parhash->ctx[HASH_SHA256].update = sha256_update;
-    parhash->ctx[HASH_SHA256].final = sha256_final;
-
-    parhash->ctx[HASH_SHA512].pub.name = "sha512";
-    parhash->ctx[HASH_SHA512].pub.size = 512 / 8;
-    parhash->ctx[HASH_SHA512].init = sha512_init;
-    parhash->ctx[HASH_SHA512].update = sha512_update;
-    parhash->ctx[HASH_SHA512].final = sha512_final;
-
+    parhash->nb_ctx = 0;
     for (i = 0; i < NB_HASH; i++) {
-        parhash->ctx[i].parhash = parhash;
-        parhash->ctx[i].pub.disabled = 0;
-        pthread_mutex_init(&parhash->ctx[i].mutex, NULL);
-        pthread_cond_init(&parhash->ctx[i].cond, NULL);
+        if (!(mask & (1 << i)))
+            continue;
+        parhash->ctx[parhash->nb_ctx].algo = &hash_algos[i];
+        parhash->ctx[parhash->nb_ctx].pub.name = hash_algos[i].name;
+        parhash->ctx[parhash->nb_ctx].pub.size = hash_algos[i].size;
+        parhash->ctx[parhash->nb_ctx].pub.disabled = 0;
+        parhash->ctx[parhash->nb_ctx].resume = 0;
+        parhash->nb_ctx++;
+    }
+    if (nb_threads == 0 || nb_threads >= parhash->nb_ctx) {
+        parhash->nb_threads = parhash->nb_ctx;
+        parhash->block = sizeof(parhash->buf);
+    } else {
+        parhash->nb_threads = nb_threads;
+        parhash->block = STITCH_BLOCK;
+    }
+
+    pthread_once(&sigbus_once, parhash_sigbus_setup);
+    parhash->wpos = 0;
+    parhash->eof = 0;
+    parhash->stream = 0;
+    parhash->ext = NULL;
+    parhash->zero_end = 0;
+    event_init(&parhash->event);
+    for (i = 0; i < parhash->nb_threads; i++) {
+        th = &parhash->thread[i];
+        th->parhash = parhash;
+        th->rpos = 0;
+        th->stream = 0;
+        th->stream_done = 0;
+        th->started = 0;
+        th->quit = 0;
+        th->has_thread = 0;
+        th->nb_ctx = 0;
+        event_init(&th->event);
+    }
+    for (i = 0; i < parhash->nb_ctx; i++) {
+        th = &parhash->thread[i % parhash->nb_threads];
+        th->ctx[th->nb_ctx++] = &parhash->ctx[i];
+    }
+    for (i = 0; i < parhash->nb_threads; i++) {
+        th = &parhash->thread[i];
+        if (pthread_create(&th->thread, NULL, parhash_thread, th) != 0) {
+            perror("pthread_create");
+            parhash_free(&parhash);
+            return -1;
+        }
+        th->has_thread = 1;
     }
 
     *rparhash = parhash;
@@ -226,121 +676,360 @@ parhash_alloc(Parhash **rparhash)
 }
 
 void
-parhash_free(Parhash **parhash)
+parhash_free(Parhash **rparhash)
 {
-    free(*parhash);
-    *parhash = NULL;
+    Parhash *parhash = *rparhash;
+    Hash_thread *th;
+    unsigned i;
+
+    for (i = 0; i < parhash->nb_threads; i++) {
+        th = &parhash->thread[i];
+        if (!th->has_thread)
+            continue;
+        STORE_SC(th->quit, 1);
+        event_signal(&th->event);
+        pthread_join(th->thread, NULL);
+    }
+    for (i = 0; i < parhash->nb_threads; i++)
+        event_uninit(&parhash->thread[i].event);
+    event_uninit(&parhash->event);
+    free(parhash);
+    *rparhash = NULL;
 }
 
 Parhash_info *
 parhash_get_info(Parhash *parhash, unsigned idx)
 {
-    return idx < NB_HASH ? &parhash->ctx[idx].pub : NULL;
+    return idx < parhash->nb_ctx ? &parhash->ctx[idx].pub : NULL;
+}
+
+static void
+parhash_hash_buffers_scalar(const Hash_algo *algo, const uint8_t *buf,
+    size_t size, uint8_t *out)
+{
+    Hash_state state;
+
+    algo->init(&state);
+    algo->update(&state, buf, size);
+    algo->final(&state, out, algo->size);
+}
+
+void
+parhash_hash_buffers(Parhash *parhash, unsigned nb,
+    const uint8_t *const *buf, const size_t *size, Parhash_info *const *hi)
+{
+    const Hash_algo *algo;
+    Mbhash_msg msg[MB_CHUNK];
+    unsigned i, j, nb_msg;
+
+    for (j = 0; j < parhash->nb_ctx; j++) {
+        algo = parhash->ctx[j].algo;
+        nb_msg = 0;
+        for (i = 0; i < nb; i++) {
+            hi[i][j].utime_sec = 0;
+            hi[i][j].utime_msec = 0;
+            hi[i][j].idle_usec = 0;
+            hi[i][j].stall_usec = 0;
+            hi[i][j].bytes = size[i];
+            if (hi[i][j].disabled)
+                continue;
+            if (algo->mbhash < 0 || mbhash_lanes(algo->mbhash) == 0) {
+                parhash_hash_buffers_scalar(algo, buf[i], size[i],
+                    hi[i][j].out);
+                continue;
+            }
+            msg[nb_msg++] = (Mbhash_msg) {
+                .data = buf[i], .size = size[i], .out = hi[i][j].out };
+            if (nb_msg == MB_CHUNK) {
+                mbhash_run(algo->mbhash, msg, nb_msg);
+                nb_msg = 0;
+            }
+        }
+        if (nb_msg == 1)
+            parhash_hash_buffers_scalar(algo, msg[0].data, msg[0].size,
+                msg[0].out);
+        else if (nb_msg > 1)
+            mbhash_run(algo->mbhash, msg, nb_msg);
+    }
+}
+
+unsigned
+parhash_batch_size(Parhash *parhash)
+{
+    const Hash_algo *algo;
+    unsigned i, lanes, r = 1;
+
+    for (i = 0; i < parhash->nb_ctx; i++) {
+        algo = parhash->ctx[i].algo;
+        if (algo->mbhash < 0)
+            continue;
+        lanes = mbhash_lanes(algo->mbhash);
+        if (lanes > r)
+            r = lanes;
+    }
+    return r;
+}
+
+void
+parhash_merkle(Parhash *parhash, size_t nb, const Parhash_info *hi,
+    Parhash_info *root)
+{
+    const Hash_algo *algo;
+    uint8_t *level, node[1 + 2 * sizeof(hi->out)];
+    size_t i, n;
+    unsigned j, size;
+
+    level = malloc(nb * sizeof(hi->out));
+    if (level == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (j = 0; j < parhash->nb_ctx; j++) {
+        algo = parhash->ctx[j].algo;
+        size = algo->size;
+        for (i = 0; i < nb; i++)
+            memcpy(level + i * size, hi[i * parhash->nb_ctx + j].out, size);
+        for (n = nb; n > 1; n = (n + 1) / 2) {
+            node[0] = 1;
+            for (i = 0; i + 1 < n; i += 2) {
+                memcpy(node + 1, level + i * size, 2 * size);
+                parhash_hash_buffers_scalar(algo, node, 1 + 2 * size,
+                    level + i / 2 * size);
+            }
+            if (i < n)
+                memmove(level + i / 2 * size, level + i * size, size);
+        }
+        root[j].name = algo->name;
+        root[j].size = size;
+        memcpy(root[j].out, level, size);
+    }
+    free(level);
 }
 
 int
 parhash_start(Parhash *parhash)
 {
-    Hash_context *ctx;
-    unsigned i;
+    Hash_thread *th;
+    unsigned i, j;
 
-    parhash->pos = 0;
+    /* the buffer is empty, the stream can start anywhere */
+    parhash->wpos = (parhash->wpos + BUF_ALIGN - 1) &
+        ~(uint64_t)(BUF_ALIGN - 1);
     parhash->avail = sizeof(parhash->buf);
-    for (i = 0; i < NB_HASH; i++) {
-        ctx = &parhash->ctx[i];
-        ctx->pub.utime_sec = 0;
-        ctx->pub.utime_msec = 0;
-        ctx->buf_fill = 0;
-        ctx->eof = 0;
-        ctx->started = 0;
+    parhash->stream++;
+    STORE(parhash->eof, 0);
+    for (i = 0; i < parhash->nb_ctx; i++) {
+        parhash->ctx[i].pub.utime_sec = 0;
+        parhash->ctx[i].pub.utime_msec = 0;
+        parhash->ctx[i].pub.idle_usec = 0;
+        parhash->ctx[i].pub.stall_usec = 0;
+        parhash->ctx[i].pub.bytes = 0;
     }
-    for (i = 0; i < NB_HASH; i++) {
-        ctx = &parhash->ctx[i];
-        if (ctx->pub.disabled)
+    for (i = 0; i < parhash->nb_threads; i++) {
+        th = &parhash->thread[i];
+        th->started = 0;
+        th->stall_usec = 0;
+        for (j = 0; j < th->nb_ctx; j++)
+            if (!th->ctx[j]->pub.disabled)
+                break;
+        if (j == th->nb_ctx)
             continue;
-        if (pthread_create(&ctx->thread, NULL, parhash_thread, ctx) < 0) {
-            perror("pthread_create");
-            return -1;
-        }
-        ctx->started = 1;
+        /* the thread is idle and will see rpos with the new stream */
+        th->rpos = parhash->wpos;
+        STORE_SC(th->stream, parhash->stream);
+        event_signal(&th->event);
+        th->started = 1;
     }
     return 0;
 }
 
+/* returns the free space in the ring, updated */
+static size_t
+parhash_update_avail(Parhash *parhash, unsigned *slowest)
+{
+    uint64_t fill, fill_max = 0;
+    unsigned i;
+
+    for (i = 0; i < parhash->nb_threads; i++) {
+        if (!parhash->thread[i].started)
+            continue;
+        fill = parhash->wpos - LOAD_SC(parhash->thread[i].rpos);
+        if (fill > fill_max) {
+            fill_max = fill;
+            *slowest = i;
+        }
+    }
+    /* a zero run can put the hashes further than the buffer */
+    parhash->avail = fill_max < sizeof(parhash->buf) ?
+        sizeof(parhash->buf) - fill_max : 0;
+    return parhash->avail;
+}
+
 void
 parhash_wait_buffer(Parhash *parhash, size_t min)
 {
-    Hash_context *ctx;
-    unsigned fill_max, i;
+    uint64_t t;
+    unsigned seq, slowest = 0;
 
-    if (parhash->avail < min) {
-        fill_max = 0;
-        for (i = 0; i < NB_HASH; i++) {
-            ctx = &parhash->ctx[i];
-            if (ctx->pub.disabled)
-                continue;
-            pthread_mutex_lock(&ctx->mutex);
-            while (ctx->buf_fill > sizeof(parhash->buf) - min)
-                pthread_cond_wait(&ctx->cond, &ctx->mutex);
-            if (ctx->buf_fill > fill_max)
-                fill_max = ctx->buf_fill;
-            pthread_mutex_unlock(&ctx->mutex);
+    while (parhash->avail < min) {
+        seq = event_prepare(&parhash->event);
+        if (parhash_update_avail(parhash, &slowest) >= min) {
+            event_cancel(&parhash->event);
+            break;
         }
-        parhash->avail = sizeof(parhash->buf) - fill_max;
+        /* the wait is blamed on the thread furthest behind */
+        t = clock_usec();
+        event_wait(&parhash->event, seq);
+        parhash->thread[slowest].stall_usec += clock_usec() - t;
     }
 }
 
+int
+parhash_poll_buffer(Parhash *parhash, size_t min)
+{
+    unsigned slowest;
+
+    return parhash->avail >= min ||
+        parhash_update_avail(parhash, &slowest) >= min;
+}
+
 unsigned
-parhash_get_buffer(Parhash *parhash, size_t max,
+parhash_peek_buffer(Parhash *parhash, size_t skip, size_t max,
     void **b1, size_t *s1, void **b2, size_t *s2)
 {
-    size_t size = parhash->avail < max ? parhash->avail : max;
+    size_t size = parhash->avail - skip < max ? parhash->avail - skip : max;
+    unsigned pos = (parhash->wpos + skip) & (sizeof(parhash->buf) - 1);
 
-    *b1 = parhash->buf + parhash->pos;
-    if (size <= sizeof(parhash->buf) - parhash->pos) {
+    *b1 = parhash->buf + pos;
+    if (size <= sizeof(parhash->buf) - pos) {
         *s1 = size;
         return 1;
     } else {
-        *s1 = sizeof(parhash->buf) - parhash->pos;
+        *s1 = sizeof(parhash->buf) - pos;
         *b2 = parhash->buf;
         *s2 = size - *s1;
         return 2;
     }
 }
 
+unsigned
+parhash_get_buffer(Parhash *parhash, size_t max,
+    void **b1, size_t *s1, void **b2, size_t *s2)
+{
+    return parhash_peek_buffer(parhash, 0, max, b1, s1, b2, s2);
+}
+
 void
 parhash_advance(Parhash *parhash, size_t size)
 {
     unsigned i;
 
-    parhash->pos += size;
-    parhash->pos &= sizeof(parhash->buf) - 1;
     parhash->avail -= size;
-    for (i = 0; i < NB_HASH; i++) {
-        if (parhash->ctx[i].pub.disabled)
-            continue;
-        pthread_mutex_lock(&parhash->ctx[i].mutex);
-        parhash->ctx[i].buf_fill += size;
-        pthread_mutex_unlock(&parhash->ctx[i].mutex);
-        pthread_cond_signal(&parhash->ctx[i].cond);
-    }
+    STORE_SC(parhash->wpos, parhash->wpos + size);
+    for (i = 0; i < parhash->nb_threads; i++)
+        if (parhash->thread[i].started)
+            event_signal(&parhash->thread[i].event);
 }
 
-void parhash_finish(Parhash *parhash)
+void
+parhash_zero(Parhash *parhash, uint64_t size)
 {
     unsigned i;
 
-    for (i = 0; i < NB_HASH; i++) {
-        if (!parhash->ctx[i].started)
+    /* a single run at a time: let all the hashes reach this one */
+    parhash_wait_buffer(parhash, sizeof(parhash->buf));
+    STORE(parhash->zero_end, parhash->wpos + size);
+    STORE_SC(parhash->wpos, parhash->wpos + size);
+    parhash->avail = 0;
+    for (i = 0; i < parhash->nb_threads; i++)
+        if (parhash->thread[i].started)
+            event_signal(&parhash->thread[i].event);
+}
+
+void parhash_finish(Parhash *parhash)
+{
+    Hash_thread *th;
+    uint64_t t;
+    unsigned i, j, seq;
+
+    STORE_SC(parhash->eof, 1);
+    for (i = 0; i < parhash->nb_threads; i++)
+        if (parhash->thread[i].started)
+            event_signal(&parhash->thread[i].event);
+    for (i = 0; i < parhash->nb_threads; i++) {
+        th = &parhash->thread[i];
+        if (!th->started)
             continue;
-        pthread_mutex_lock(&parhash->ctx[i].mutex);
-        parhash->ctx[i].eof = 1;
-        pthread_mutex_unlock(&parhash->ctx[i].mutex);
-        pthread_cond_signal(&parhash->ctx[i].cond);
+        while (1) {
+            seq = event_prepare(&parhash->event);
+            if (LOAD_SC(th->stream_done) == parhash->stream) {
+                event_cancel(&parhash->event);
+                break;
+            }
+            t = clock_usec();
+            event_wait(&parhash->event, seq);
+            th->stall_usec += clock_usec() - t;
+        }
+        for (j = 0; j < th->nb_ctx; j++)
+            if (!th->ctx[j]->pub.disabled)
+                th->ctx[j]->pub.stall_usec = th->stall_usec;
     }
-    for (i = 0; i < NB_HASH; i++) {
-        if (parhash->ctx[i].pub.disabled)
-            continue;
-        pthread_join(parhash->ctx[i].thread, NULL);
+    for (i = 0; i < parhash->nb_ctx; i++)
+        parhash->ctx[i].resume = 0;
+}
+
+size_t
+parhash_state_size(void)
+{
+    return sizeof(Hash_state);
+}
+
+void
+parhash_state_format(char *buf, size_t size)
+{
+    const uint16_t one = 1;
+
+    snprintf(buf, size, "%d.%zu.%c.%lx", STATE_FORMAT, sizeof(Hash_state),
+        *(const uint8_t *)&one ? 'l' : 'b', OpenSSL_version_num());
+}
+
+void
+parhash_save_state(Parhash *parhash, unsigned idx, uint8_t *buf)
+{
+    memcpy(buf, &parhash->ctx[idx].saved, sizeof(Hash_state));
+}
+
+void
+parhash_load_state(Parhash *parhash, unsigned idx, const uint8_t *buf)
+{
+    memcpy(&parhash->ctx[idx].saved, buf, sizeof(Hash_state));
+    parhash->ctx[idx].resume = 1;
+}
+
+int
+parhash_hash_mapped(Parhash *parhash, const uint8_t *data, size_t size)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE), a;
+    size_t done = 0, chunk;
+
+    parhash_start(parhash);
+    parhash->ext = data;
+    parhash->ext_start = parhash->wpos;
+    parhash->ext_failed = 0;
+    a = (uintptr_t)data & ~(page - 1);
+    madvise((void *)a, size + ((uintptr_t)data - a), MADV_SEQUENTIAL);
+    while (done < size) {
+        /* keep the hashes within the size of the buffer from each other */
+        parhash_wait_buffer(parhash, MAPPED_WINDOW);
+        chunk = size - done < MAPPED_WINDOW ? size - done : MAPPED_WINDOW;
+        if (size - done > chunk) {
+            a = (uintptr_t)(data + done + chunk) & ~(page - 1);
+            madvise((void *)a, MAPPED_WINDOW, MADV_WILLNEED);
+        }
+        parhash_advance(parhash, chunk);
+        done += chunk;
     }
+    parhash_finish(parhash);
+    parhash->ext = NULL;
+    return LOAD(parhash->ext_failed) ? -1 : 0;
 }
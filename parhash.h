@@ -15,6 +15,13 @@
 typedef struct Parhash_info {
     const char *name;
     uint64_t utime_sec, utime_msec;
+    /** time the thread of this hash waited for data, in microseconds */
+    uint64_t idle_usec;
+    /** time the producer waited for the thread of this hash to free the
+        buffer, in microseconds */
+    uint64_t stall_usec;
+    /** number of bytes hashed */
+    uint64_t bytes;
     uint8_t size;
     uint8_t disabled;
     uint8_t out[64];
@@ -22,12 +29,49 @@ typedef struct Parhash_info {
 
 typedef struct Parhash Parhash;
 
-int parhash_alloc(Parhash **rparhash);
+/**
+ * Allocate a Parhash computing the hashes in the comma-separated list,
+ * or all supported hashes if hashes is NULL.
+ * If nb_threads is not 0 and less than the number of hashes, the hashes
+ * are shared among nb_threads threads and each thread runs its hashes in
+ * turn on cache-sized blocks of the ring.
+ */
+int parhash_alloc(Parhash **rparhash, const char *hashes,
+    unsigned nb_threads);
 
 void parhash_free(Parhash **parhash);
 
 Parhash_info *parhash_get_info(Parhash *parhash, unsigned idx);
 
+/**
+ * Hash nb complete buffers in the calling thread, without the ring.
+ * hi[i] is an array with one entry per hash, in the order of
+ * parhash_get_info(), where the results for buf[i] are stored; entries
+ * with disabled set are skipped. Gives the same results as streams with
+ * the same data, several buffers can be hashed at once with SIMD.
+ */
+void parhash_hash_buffers(Parhash *parhash, unsigned nb,
+    const uint8_t *const *buf, const size_t *size, Parhash_info *const *hi);
+
+/**
+ * Number of buffers worth giving to parhash_hash_buffers() at once.
+ */
+unsigned parhash_batch_size(Parhash *parhash);
+
+/**
+ * Compute the Merkle root of nb blocks for each hash: hi holds the
+ * digests of the blocks, nb arrays of one entry per hash; a node is the
+ * hash of a 0x01 byte and its two children, an odd node is promoted
+ * unchanged; the results are stored in root.
+ */
+void parhash_merkle(Parhash *parhash, size_t nb, const Parhash_info *hi,
+    Parhash_info *root);
+
+/**
+ * Start a new stream; the buffer given by parhash_get_buffer() is then
+ * aligned on 4096 bytes, so are the following ones if the sizes given
+ * to parhash_advance() are multiples of 4096.
+ */
 int parhash_start(Parhash *parhash);
 
 void parhash_wait_buffer(Parhash *parhash, size_t min);
@@ -35,6 +79,60 @@ void parhash_wait_buffer(Parhash *parhash, size_t min);
 unsigned parhash_get_buffer(Parhash *parhash, size_t max,
     void **b1, size_t *s1, void **b2, size_t *s2);
 
+/**
+ * Check without blocking if at least min bytes are free in the buffer.
+ */
+int parhash_poll_buffer(Parhash *parhash, size_t min);
+
+/**
+ * Like parhash_get_buffer() but for the free space after the skip first
+ * bytes, to fill several parts of the buffer at once; skip must be less
+ * than the free space checked with parhash_wait_buffer() or
+ * parhash_poll_buffer().
+ */
+unsigned parhash_peek_buffer(Parhash *parhash, size_t skip, size_t max,
+    void **b1, size_t *s1, void **b2, size_t *s2);
+
 void parhash_advance(Parhash *parhash, size_t size);
 
+/**
+ * Append size zero bytes to the stream without using the buffer; the
+ * hashes with a shortcut for runs of zeros use it.
+ * The next buffer is aligned like after parhash_advance().
+ */
+void parhash_zero(Parhash *parhash, uint64_t size);
+
 void parhash_finish(Parhash *parhash);
+
+/**
+ * Hash data in memory, typically a mapped file, as a complete stream:
+ * the hashing threads read it directly, without copy.
+ * Returns -1 if reading the data raised SIGBUS, for example because the
+ * file was truncated; the results are then invalid.
+ */
+int parhash_hash_mapped(Parhash *parhash, const uint8_t *data, size_t size);
+
+/**
+ * Size of a saved hash state; the format is only valid for the same
+ * build on the same machine.
+ */
+size_t parhash_state_size(void);
+
+/**
+ * Identify the format of the saved states: layout version, size, byte
+ * order and OpenSSL version; states saved with another format must not
+ * be loaded.
+ */
+void parhash_state_format(char *buf, size_t size);
+
+/**
+ * Save the state of hash idx at the end of the last stream, before
+ * finalization.
+ */
+void parhash_save_state(Parhash *parhash, unsigned idx, uint8_t *buf);
+
+/**
+ * Make the next stream of hash idx continue from a saved state instead
+ * of starting from scratch.
+ */
+void parhash_load_state(Parhash *parhash, unsigned idx, const uint8_t *buf);
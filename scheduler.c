@@ -0,0 +1,359 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+
+typedef struct Scheduler_slot {
+    void *job;
+    unsigned queue;
+    uint8_t flags;
+    uint8_t taken;
+    uint8_t done;
+} Scheduler_slot;
+
+typedef struct Scheduler_worker {
+    Scheduler *sched;
+    pthread_t thread;
+    unsigned idx;
+    void **jobs;
+    Scheduler_slot **slots;
+} Scheduler_worker;
+
+/*
+ * The slots between head and tail form a reorder buffer: jobs are taken
+ * by the workers from next, in order unless their queue is busy, and
+ * output when the one at head is done.
+ */
+struct Scheduler {
+    Scheduler_slot *slots;
+    Scheduler_worker *workers;
+    unsigned nb_workers;
+    unsigned nb_started;
+    unsigned window;
+    unsigned batch;
+    unsigned head, next, tail;
+    unsigned nb_batch; /* batchable jobs between next and tail */
+    unsigned nb_single; /* other jobs to process between next and tail */
+    unsigned *running; /* jobs being processed, for each queue */
+    unsigned nb_queues;
+    unsigned queue_limit;
+    uint8_t draining;
+    uint8_t quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_work;
+    pthread_cond_t cond_done;
+    void (*process)(void *opaque, unsigned worker, void **jobs, unsigned nb);
+    void (*output)(void *opaque, void *job);
+    void *opaque;
+};
+
+/* called with the mutex held */
+static void
+scheduler_skip(Scheduler *sched)
+{
+    Scheduler_slot *slot;
+
+    /* jobs that need no processing can be output before being seen */
+    if ((int)(sched->head - sched->next) > 0)
+        sched->next = sched->head;
+    while (sched->next != sched->tail) {
+        slot = &sched->slots[sched->next % sched->window];
+        if ((slot->flags & SCHEDULER_PROCESS) && !slot->taken)
+            break;
+        sched->next++;
+    }
+}
+
+/* called with the mutex held, returns the number of slots taken */
+static unsigned
+scheduler_take(Scheduler *sched, Scheduler_worker *worker)
+{
+    Scheduler_slot *slot;
+    unsigned pos, queue = 0, nb = 0;
+
+    scheduler_skip(sched);
+    for (pos = sched->next; pos != sched->tail; pos++) {
+        slot = &sched->slots[pos % sched->window];
+        if (!(slot->flags & SCHEDULER_PROCESS) || slot->taken)
+            continue;
+        /* a batch is taken from a single queue */
+        if (nb == 0) {
+            if (sched->running[slot->queue] >= sched->queue_limit)
+                continue;
+            queue = slot->queue;
+        } else if (slot->queue != queue) {
+            continue;
+        }
+        if (!(slot->flags & SCHEDULER_BATCH)) {
+            if (nb == 0) {
+                worker->slots[nb++] = slot;
+                slot->taken = 1;
+                sched->nb_single--;
+            }
+            break;
+        }
+        /* wait for more unless something else is queued behind */
+        if (nb == 0 && sched->nb_batch < sched->batch &&
+            sched->nb_single == 0 && !sched->draining && !sched->quit)
+            break;
+        worker->slots[nb++] = slot;
+        slot->taken = 1;
+        sched->nb_batch--;
+        if (nb == sched->batch)
+            break;
+    }
+    if (nb > 0)
+        sched->running[queue]++;
+    scheduler_skip(sched);
+    return nb;
+}
+
+static void *
+scheduler_thread(void *worker_v)
+{
+    Scheduler_worker *worker = worker_v;
+    Scheduler *sched = worker->sched;
+    unsigned i, nb, queue;
+
+    pthread_mutex_lock(&sched->mutex);
+    while (1) {
+        nb = scheduler_take(sched, worker);
+        if (nb == 0) {
+            if (sched->quit && sched->next == sched->tail)
+                break;
+            pthread_cond_wait(&sched->cond_work, &sched->mutex);
+            continue;
+        }
+        for (i = 0; i < nb; i++)
+            worker->jobs[i] = worker->slots[i]->job;
+        queue = worker->slots[0]->queue;
+        if (sched->next != sched->tail)
+            pthread_cond_signal(&sched->cond_work);
+        pthread_mutex_unlock(&sched->mutex);
+        sched->process(sched->opaque, worker->idx, worker->jobs, nb);
+        pthread_mutex_lock(&sched->mutex);
+        for (i = 0; i < nb; i++)
+            worker->slots[i]->done = 1;
+        pthread_cond_signal(&sched->cond_done);
+        /* the jobs of this queue left behind can be taken now */
+        sched->running[queue]--;
+        if (sched->running[queue] + 1 == sched->queue_limit &&
+            sched->next != sched->tail)
+            pthread_cond_broadcast(&sched->cond_work);
+    }
+    pthread_mutex_unlock(&sched->mutex);
+    return NULL;
+}
+
+int
+scheduler_alloc(Scheduler **rsched, unsigned nb_workers, unsigned window,
+    unsigned batch,
+    void (*process)(void *opaque, unsigned worker, void **jobs, unsigned nb),
+    void (*output)(void *opaque, void *job), void *opaque)
+{
+    Scheduler *sched;
+    unsigned i;
+
+    sched = malloc(sizeof(*sched));
+    if (sched == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    sched->slots = calloc(window, sizeof(*sched->slots));
+    sched->workers = calloc(nb_workers, sizeof(*sched->workers));
+    sched->running = calloc(1, sizeof(*sched->running));
+    if (sched->slots == NULL || sched->workers == NULL ||
+        sched->running == NULL) {
+        perror("malloc");
+        free(sched->slots);
+        free(sched->workers);
+        free(sched->running);
+        free(sched);
+        return -1;
+    }
+    if (batch < 1)
+        batch = 1;
+    if (batch > window)
+        batch = window;
+    for (i = 0; i < nb_workers; i++) {
+        sched->workers[i].jobs = malloc(batch * sizeof(void *));
+        sched->workers[i].slots = malloc(batch * sizeof(Scheduler_slot *));
+        if (sched->workers[i].jobs == NULL ||
+            sched->workers[i].slots == NULL) {
+            perror("malloc");
+            for (i = 0; i < nb_workers; i++) {
+                free(sched->workers[i].jobs);
+                free(sched->workers[i].slots);
+            }
+            free(sched->slots);
+            free(sched->workers);
+            free(sched->running);
+            free(sched);
+            return -1;
+        }
+    }
+    sched->nb_workers = nb_workers;
+    sched->nb_started = 0;
+    sched->window = window;
+    sched->batch = batch;
+    sched->head = sched->next = sched->tail = 0;
+    sched->nb_batch = 0;
+    sched->nb_single = 0;
+    sched->nb_queues = 1;
+    sched->queue_limit = nb_workers;
+    sched->draining = 0;
+    sched->quit = 0;
+    sched->process = process;
+    sched->output = output;
+    sched->opaque = opaque;
+    pthread_mutex_init(&sched->mutex, NULL);
+    pthread_cond_init(&sched->cond_work, NULL);
+    pthread_cond_init(&sched->cond_done, NULL);
+    for (i = 0; i < nb_workers; i++) {
+        sched->workers[i].sched = sched;
+        sched->workers[i].idx = i;
+        if (pthread_create(&sched->workers[i].thread, NULL, scheduler_thread,
+            &sched->workers[i]) != 0) {
+            perror("pthread_create");
+            scheduler_free(&sched);
+            return -1;
+        }
+        sched->nb_started++;
+    }
+    *rsched = sched;
+    return 0;
+}
+
+void
+scheduler_free(Scheduler **rsched)
+{
+    Scheduler *sched = *rsched;
+    unsigned i;
+
+    scheduler_flush(sched);
+    pthread_mutex_lock(&sched->mutex);
+    sched->quit = 1;
+    pthread_cond_broadcast(&sched->cond_work);
+    pthread_mutex_unlock(&sched->mutex);
+    for (i = 0; i < sched->nb_started; i++)
+        pthread_join(sched->workers[i].thread, NULL);
+    pthread_mutex_destroy(&sched->mutex);
+    pthread_cond_destroy(&sched->cond_work);
+    pthread_cond_destroy(&sched->cond_done);
+    for (i = 0; i < sched->nb_workers; i++) {
+        free(sched->workers[i].jobs);
+        free(sched->workers[i].slots);
+    }
+    free(sched->slots);
+    free(sched->workers);
+    free(sched->running);
+    free(sched);
+    *rsched = NULL;
+}
+
+int
+scheduler_set_queues(Scheduler *sched, unsigned nb_queues, unsigned limit)
+{
+    unsigned *running;
+
+    running = calloc(nb_queues, sizeof(*running));
+    if (running == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    pthread_mutex_lock(&sched->mutex);
+    free(sched->running);
+    sched->running = running;
+    sched->nb_queues = nb_queues;
+    sched->queue_limit = limit;
+    pthread_mutex_unlock(&sched->mutex);
+    return 0;
+}
+
+/* called with the mutex held */
+static void
+scheduler_output(Scheduler *sched, unsigned keep, int wait)
+{
+    Scheduler_slot *slot;
+    void *job;
+
+    while (sched->tail - sched->head > keep) {
+        slot = &sched->slots[sched->head % sched->window];
+        if (!slot->done) {
+            if (!wait)
+                break;
+            /* incomplete batches must not make the output wait */
+            if (!sched->draining) {
+                sched->draining = 1;
+                pthread_cond_broadcast(&sched->cond_work);
+            }
+            pthread_cond_wait(&sched->cond_done, &sched->mutex);
+            continue;
+        }
+        job = slot->job;
+        sched->head++;
+        pthread_mutex_unlock(&sched->mutex);
+        sched->output(sched->opaque, job);
+        pthread_mutex_lock(&sched->mutex);
+    }
+    sched->draining = 0;
+}
+
+void
+scheduler_submit(Scheduler *sched, void *job, unsigned flags)
+{
+    scheduler_submit_queue(sched, job, flags, 0);
+}
+
+void
+scheduler_submit_queue(Scheduler *sched, void *job, unsigned flags,
+    unsigned queue)
+{
+    Scheduler_slot *slot;
+
+    if (!(flags & SCHEDULER_PROCESS))
+        flags = 0;
+    pthread_mutex_lock(&sched->mutex);
+    scheduler_output(sched, sched->window - 1, 1);
+    slot = &sched->slots[sched->tail % sched->window];
+    slot->job = job;
+    slot->queue = queue % sched->nb_queues;
+    slot->flags = flags;
+    slot->taken = 0;
+    slot->done = !flags;
+    sched->tail++;
+    if ((flags & SCHEDULER_BATCH)) {
+        sched->nb_batch++;
+        if (sched->nb_batch >= sched->batch)
+            pthread_cond_signal(&sched->cond_work);
+    } else if (flags) {
+        sched->nb_single++;
+        pthread_cond_signal(&sched->cond_work);
+    }
+    scheduler_output(sched, 0, 0);
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+void
+scheduler_flush(Scheduler *sched)
+{
+    pthread_mutex_lock(&sched->mutex);
+    scheduler_output(sched, 0, 1);
+    pthread_mutex_unlock(&sched->mutex);
+}
@@ -0,0 +1,64 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * Run jobs on a pool of worker threads and hand them back in submission
+ * order: process() is called from the workers, output() from the thread
+ * calling scheduler_submit() and scheduler_flush().
+ */
+
+typedef struct Scheduler Scheduler;
+
+/* The job must be processed before being output */
+#define SCHEDULER_PROCESS 1
+/* The job can be processed together with neighbouring batchable jobs */
+#define SCHEDULER_BATCH   2
+
+/**
+ * Up to batch consecutive batchable jobs are given to process() at once;
+ * a worker waits for a full batch unless the output is waiting for them.
+ */
+int scheduler_alloc(Scheduler **rsched, unsigned nb_workers, unsigned window,
+    unsigned batch,
+    void (*process)(void *opaque, unsigned worker, void **jobs, unsigned nb),
+    void (*output)(void *opaque, void *job), void *opaque);
+
+void scheduler_free(Scheduler **rsched);
+
+/**
+ * Split the jobs into nb_queues queues, of which at most limit jobs are
+ * processed at the same time; the others are taken in order past the
+ * busy queues.
+ * Must be called before submitting anything.
+ */
+int scheduler_set_queues(Scheduler *sched, unsigned nb_queues,
+    unsigned limit);
+
+/**
+ * Queue a job; flags is a combination of SCHEDULER_*, without
+ * SCHEDULER_PROCESS the job is only output, in order.
+ * Blocks if the window of pending jobs is full.
+ */
+void scheduler_submit(Scheduler *sched, void *job, unsigned flags);
+
+/**
+ * Queue a job in the given queue, modulo the number of queues.
+ */
+void scheduler_submit_queue(Scheduler *sched, void *job, unsigned flags,
+    unsigned queue);
+
+/**
+ * Wait for all the pending jobs and output them.
+ */
+void scheduler_flush(Scheduler *sched);
@@ -0,0 +1,119 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "throttle.h"
+
+/* Credit accumulated while idle, in seconds of each rate */
+#define THROTTLE_BURST 0.1
+
+/*
+ * Each bucket is kept as the time when its credit is used up: a read may
+ * start once that time is reached and pushes it by its cost.
+ */
+struct Throttle {
+    pthread_mutex_t mutex;
+    double rate[2];
+    double until[2];
+    uint64_t bytes;
+    uint64_t reads;
+    double waited;
+};
+
+static double
+throttle_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+int
+throttle_alloc(Throttle **rthrottle, uint64_t bytes_per_sec,
+    unsigned reads_per_sec)
+{
+    Throttle *throttle;
+
+    throttle = calloc(1, sizeof(*throttle));
+    if (throttle == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    pthread_mutex_init(&throttle->mutex, NULL);
+    throttle->rate[0] = bytes_per_sec;
+    throttle->rate[1] = reads_per_sec;
+    *rthrottle = throttle;
+    return 0;
+}
+
+void
+throttle_free(Throttle **rthrottle)
+{
+    Throttle *throttle = *rthrottle;
+
+    pthread_mutex_destroy(&throttle->mutex);
+    free(throttle);
+    *rthrottle = NULL;
+}
+
+void
+throttle_read(Throttle *throttle, size_t size)
+{
+    double now, start = 0, cost[2] = { size, 1 };
+    struct timespec ts;
+    unsigned i;
+
+    if (throttle == NULL)
+        return;
+    pthread_mutex_lock(&throttle->mutex);
+    now = throttle_clock();
+    for (i = 0; i < 2; i++) {
+        if (throttle->rate[i] == 0)
+            continue;
+        if (throttle->until[i] < now - THROTTLE_BURST)
+            throttle->until[i] = now - THROTTLE_BURST;
+        if (throttle->until[i] > start)
+            start = throttle->until[i];
+        throttle->until[i] += cost[i] / throttle->rate[i];
+    }
+    throttle->bytes += size;
+    throttle->reads++;
+    if (start > now)
+        throttle->waited += start - now;
+    pthread_mutex_unlock(&throttle->mutex);
+    if (start <= now)
+        return;
+    ts.tv_sec = start;
+    ts.tv_nsec = (start - ts.tv_sec) * 1E9;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+        EINTR);
+}
+
+void
+throttle_get_stats(Throttle *throttle, uint64_t *bytes, uint64_t *reads,
+    double *waited)
+{
+    pthread_mutex_lock(&throttle->mutex);
+    *bytes = throttle->bytes;
+    *reads = throttle->reads;
+    *waited = throttle->waited;
+    pthread_mutex_unlock(&throttle->mutex);
+}
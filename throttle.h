@@ -0,0 +1,41 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * Token buckets limiting the reads of all the threads to a rate of bytes
+ * and of requests per second.
+ */
+
+typedef struct Throttle Throttle;
+
+/**
+ * A rate of 0 means no limit on that count.
+ */
+int throttle_alloc(Throttle **rthrottle, uint64_t bytes_per_sec,
+    unsigned reads_per_sec);
+
+void throttle_free(Throttle **rthrottle);
+
+/**
+ * Account for a read of size bytes, waiting first if the rates would be
+ * exceeded; does nothing if throttle is NULL.
+ */
+void throttle_read(Throttle *throttle, size_t size);
+
+/**
+ * Get the number of bytes and reads accounted and the total time spent
+ * waiting by all the threads.
+ */
+void throttle_get_stats(Throttle *throttle, uint64_t *bytes,
+    uint64_t *reads, double *waited);
@@ -12,6 +12,7 @@
  * See the GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE /* for statx() and DT_* */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -21,200 +22,713 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "treewalk.h"
 
 #define PATH_LEN 4095
 #define PATH_DEPTH 64
+#define TARGET_LEN 8191
 
-typedef struct Treewalk_file {
-    char **files;
+/* buffer for the directory entries read at once */
+#define DENTS_SIZE (128 * 1024)
+
+/* entries of the directories scanned by the threads ahead of the walk */
+#define WALK_AHEAD 65536
+/* regular files opened by the threads ahead of the walk */
+#define OPEN_AHEAD 256
+
+#define NO_DEQUE UINT_MAX
+
+enum {
+    DIR_QUEUED,
+    DIR_CLAIMED,
+    DIR_DONE,
+};
+
+typedef struct Treewalk_dir Treewalk_dir;
+
+/*
+ * An examined directory entry; errors are reported when the walk reaches
+ * the entry, as if it was examined then.
+ */
+typedef struct Treewalk_entry {
+    struct stat st;
+    char *name; /* preceded by the type from the directory */
+    char *target;
+    Treewalk_dir *dir;
+    const char *error_what;
+    int error;
+    int fd;
+    uint8_t subtree_skipped;
+} Treewalk_entry;
+
+/*
+ * A directory to recurse into; it is scanned, by a thread or by the
+ * walk itself, before the walk enters it, and freed when it leaves it.
+ * error is -1 if the error was already reported.
+ */
+struct Treewalk_dir {
+    Treewalk_dir *parent;
+    char *path;
+    const char *name;
+    unsigned path_len;
+    Treewalk_entry *entries;
     char *all_files;
+    unsigned nb_entries;
+    unsigned deque;
     int fd;
+    int error;
+    const char *error_what;
+    uint8_t state;
+};
+
+typedef struct Treewalk_deque {
+    Treewalk_dir **dirs;
+    size_t head, tail, alloc;
+} Treewalk_deque;
+
+typedef struct Treewalk_thread {
+    Treewalk *tw;
+    pthread_t thread;
+    unsigned idx;
+    uint8_t *dents;
+} Treewalk_thread;
+
+typedef struct Treewalk_file {
+    Treewalk_dir *dir;
+    Treewalk_entry *entry;
     unsigned path_len;
-    unsigned nb_files;
     unsigned cur_file;
-    uint8_t subtree_skipped;
 } Treewalk_file;
 
+/*
+ * The threads take the directories to scan from deques: each thread
+ * pushes the subdirectories of the directories it scans to its own, and
+ * the walk to the last one.
+ */
 struct Treewalk {
     Treewalk_file stack[PATH_DEPTH];
     unsigned char path[PATH_LEN + 1];
-    struct stat st;
+    Treewalk_entry root;
+    Treewalk_entry *cur;
     unsigned depth;
-    char target[8192];
+    int fd;
     const char **exclude;
     size_t nb_exclude;
+    uint8_t *dents;
     uint8_t opt_follow;
+    uint8_t opt_dont_sync;
+    uint8_t started;
+    uint8_t quit;
+    unsigned nb_threads;
+    unsigned nb_started;
+    Treewalk_thread *threads;
+    Treewalk_deque *deques;
+    size_t ahead;
+    unsigned open_ahead;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_work;
+    pthread_cond_t cond_done;
+};
+
+static void
+dir_error(Treewalk_dir *dir, int error, const char *what)
+{
+    dir->error = error;
+    dir->error_what = what;
+}
+
+static void
+entry_error(Treewalk_entry *entry, int error, const char *what)
+{
+    entry->error = error;
+    entry->error_what = what;
+}
+
+/* names are stored after their type, for read_directory() */
+static int
+add_file(Treewalk_dir *file, size_t *files_alloc, size_t *files_used,
+    const char *name, unsigned type)
+{
+    char *files = file->all_files;
+    size_t size;
+
+    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+        return 0;
+    if (file->nb_entries == UINT_MAX) {
+        fprintf(stderr, "too many files\n");
+        return -1;
+    }
+    size = strlen(name) + 2;
+    if (size > *files_alloc - *files_used) {
+        while (size > *files_alloc - *files_used && *files_alloc < SIZE_MAX)
+            *files_alloc |= (*files_alloc << 1) | 0xFFF;
+        if (size > *files_alloc - *files_used) {
+            fprintf(stderr, "total file names too long\n");
+            return -1;
+        }
+        files = realloc(files, *files_alloc);
+        if (files == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        file->all_files = files;
+    }
+    files[*files_used] = type;
+    memcpy(files + *files_used + 1, name, size - 1);
+    *files_used += size;
+    file->nb_entries++;
+    return 0;
+}
+
+#ifdef __linux__
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
 };
 
+/* with getdents64(), directly on the descriptor and with a large buffer */
 static int
-read_directory_files(Treewalk_file *file, DIR *dir)
+read_directory_files(Treewalk_dir *file, uint8_t *dents)
 {
-    struct dirent *de;
-    char *files = NULL;
-    size_t files_alloc = 0, files_used = 0, size;
-    unsigned nb_files = 0;
+    struct linux_dirent64 *de;
+    size_t files_alloc = 0, files_used = 0;
+    long pos, size;
 
     while (1) {
-        errno = 0;
-        de = readdir(dir);
-        if (de == NULL && errno != 0) {
+        size = syscall(SYS_getdents64, file->fd, dents, DENTS_SIZE);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size < 0) {
             perror("readdir failed");
             break;
         }
-        if (de == NULL)
+        if (size == 0)
             break;
-        if (de->d_name[0] == '.' && (de->d_name[1] == 0 ||
-                (de->d_name[1] == '.' && de->d_name[2] == 0)))
-            continue;
-        if (nb_files == UINT_MAX) {
-            fprintf(stderr, "too many files\n");
-            return -1;
-        }
-        size = strlen(de->d_name) + 1;
-        if (size > files_alloc - files_used) {
-            while (size > files_alloc - files_used && files_alloc < SIZE_MAX)
-                files_alloc |= (files_alloc << 1) | 0xFFF;
-            if (size > files_alloc - files_used) {
-                fprintf(stderr, "total file names too long\n");
-                return -1;
-            }
-            files = realloc(files, files_alloc);
-            if (files == NULL) {
-                perror("malloc");
+        for (pos = 0; pos < size; pos += de->d_reclen) {
+            de = (struct linux_dirent64 *)(dents + pos);
+            if (add_file(file, &files_alloc, &files_used, de->d_name,
+                de->d_type) < 0)
                 return -1;
-            }
-            file->all_files = files;
         }
-        memcpy(files + files_used, de->d_name, size);
-        files_used += size;
-        nb_files++;
     }
-    file->nb_files = nb_files;
     return 0;
 }
 
-static int compare_char_ptr(const void *a, const void *b)
-{
-    return strcmp(*(const char **)a, *(const char **)b);
-}
+#else
 
 static int
-read_directory(Treewalk *tw, Treewalk_file *file)
+read_directory_files(Treewalk_dir *file, uint8_t *dents)
 {
+    struct dirent *de;
+    size_t files_alloc = 0, files_used = 0;
     DIR *dir;
-    char *f;
-    unsigned i;
-    int ret, fd;
+    int fd, ret = 0;
 
+    (void)dents;
     /* closedir() will close it, but we need it for openat() */
     fd = dup(file->fd);
     if (fd < 0) {
-        perror("dup");
+        dir_error(file, errno, "dup");
         return -1;
     }
     dir = fdopendir(fd);
     if (dir == NULL) {
-        perror(tw->path);
+        dir_error(file, errno, file->path);
+        close(fd);
         return -1;
     }
-    ret = read_directory_files(file, dir);
+    while (1) {
+        errno = 0;
+        de = readdir(dir);
+        if (de == NULL && errno != 0) {
+            perror("readdir failed");
+            break;
+        }
+        if (de == NULL)
+            break;
+        ret = add_file(file, &files_alloc, &files_used, de->d_name,
+            DT_UNKNOWN);
+        if (ret < 0)
+            break;
+    }
     closedir(dir);
-    if (ret < 0)
-        return ret;
-    file->files = calloc(file->nb_files, sizeof(*file->files));
-    if (file->files == NULL)
+    return ret;
+}
+
+#endif
+
+static int compare_char_ptr(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static int
+read_directory(Treewalk_dir *file, uint8_t *dents)
+{
+    char *f, **files;
+    unsigned i;
+
+    if (read_directory_files(file, dents) < 0) {
+        if (file->error == 0)
+            dir_error(file, -1, NULL);
+        return -1;
+    }
+    files = malloc(file->nb_entries * sizeof(*files));
+    file->entries = calloc(file->nb_entries, sizeof(*file->entries));
+    if ((files == NULL || file->entries == NULL) && file->nb_entries > 0) {
+        free(files);
+        dir_error(file, ENOMEM, "malloc");
         return -1;
+    }
     f = file->all_files;
-    for (i = 0; i < file->nb_files; i++) {
-        file->files[i] = f;
-        f = strchr(f, 0) + 1;
+    for (i = 0; i < file->nb_entries; i++) {
+        files[i] = f + 1;
+        f = strchr(f + 1, 0) + 1;
     }
-    qsort(file->files, file->nb_files, sizeof(*file->files), compare_char_ptr);
+    qsort(files, file->nb_entries, sizeof(*files), compare_char_ptr);
+    for (i = 0; i < file->nb_entries; i++) {
+        file->entries[i].name = files[i];
+        file->entries[i].fd = -1;
+    }
+    free(files);
     return 0;
 }
 
+/*
+ * Only the fields used by the walk and its callers are asked, and only
+ * the size of what can be a regular file.
+ */
 static int
-should_recurse(Treewalk *tw)
+stat_entry(Treewalk *tw, int dir, const char *name, int flags,
+    unsigned type, struct stat *st)
 {
-    size_t i;
+#ifdef STATX_TYPE
+    struct statx stx;
+    unsigned mask = STATX_TYPE | STATX_MODE | STATX_INO | STATX_MTIME;
 
-    if (!S_ISDIR(tw->st.st_mode))
+    if (type == DT_REG || type == DT_UNKNOWN ||
+        (type == DT_LNK && !(flags & AT_SYMLINK_NOFOLLOW)))
+        mask |= STATX_SIZE | STATX_NLINK;
+    if (statx(dir, name, flags | (tw->opt_dont_sync ? AT_STATX_DONT_SYNC :
+        0), mask, &stx) == 0) {
+        memset(st, 0, sizeof(*st));
+        st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        st->st_ino = stx.stx_ino;
+        st->st_mode = stx.stx_mode;
+        st->st_nlink = stx.stx_nlink;
+        st->st_size = stx.stx_size;
+        st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
         return 0;
+    }
+    if (errno != ENOSYS)
+        return -1;
+#else
+    (void)tw;
+    (void)type;
+#endif
+    return fstatat(dir, name, st, flags);
+}
+
+static Treewalk_dir *
+new_directory(Treewalk *tw, Treewalk_dir *parent, Treewalk_entry *entry)
+{
+    Treewalk_dir *dir;
+    size_t len = strlen(entry->name), i;
+    char *path;
+
+    /* the walk stops before it */
+    if (len > PATH_LEN - 1 - parent->path_len)
+        return NULL;
+    path = malloc(parent->path_len + len + 2);
+    if (path == NULL) {
+        entry_error(entry, ENOMEM, "malloc");
+        return NULL;
+    }
+    memcpy(path, parent->path, parent->path_len);
+    path[parent->path_len] = '/';
+    memcpy(path + parent->path_len + 1, entry->name, len + 1);
     for (i = 0; i < tw->nb_exclude; i++) {
-        if (strcmp(tw->path, tw->exclude[i]) == 0) {
-            tw->stack[tw->depth].subtree_skipped = 1;
-            return 0;
+        if (strcmp(path, tw->exclude[i]) == 0) {
+            entry->subtree_skipped = 1;
+            free(path);
+            return NULL;
         }
     }
-    return 1;
+    dir = calloc(1, sizeof(*dir));
+    if (dir == NULL) {
+        free(path);
+        entry_error(entry, ENOMEM, "malloc");
+        return NULL;
+    }
+    dir->parent = parent;
+    dir->path = path;
+    dir->path_len = parent->path_len + 1 + len;
+    dir->name = path + parent->path_len + 1;
+    dir->deque = NO_DEQUE;
+    dir->fd = -1;
+    dir->state = DIR_QUEUED;
+    return dir;
 }
 
-static int
-examine_file(Treewalk *tw, int dir, const char *name)
-{
-    Treewalk_file *file = &tw->stack[tw->depth];
-    unsigned flags_stat = 0, flags_open = 0;
-    int fd = -1, ret;
-
-    /* stat() before open() in order to avoid opening special files */
-    file->fd = -1;
-    file->files = NULL;
-    file->all_files = NULL;
-    file->nb_files = 0;
-    file->cur_file = 0;
-    file->subtree_skipped = 0;
+/* stat() before open() in order to avoid opening special files */
+static void
+examine_entry(Treewalk *tw, Treewalk_dir *dir, Treewalk_entry *entry,
+    int ahead)
+{
+    char target[TARGET_LEN + 1];
+    unsigned flags_stat = 0, flags_open = 0, type;
+    ssize_t ret;
+
     if (!tw->opt_follow) {
         flags_stat |= AT_SYMLINK_NOFOLLOW;
         flags_open |= O_NOFOLLOW;
     }
-    if (fstatat(dir, name, &tw->st, flags_stat) < 0 &&
+    type = entry->name[-1];
+    if (stat_entry(tw, dir->fd, entry->name, flags_stat, type,
+            &entry->st) < 0 &&
         (!tw->opt_follow || errno != ENOENT ||
-         fstatat(dir, name, &tw->st, flags_stat | AT_SYMLINK_NOFOLLOW) < 0)) {
-        perror(name);
-        return -1;
+         stat_entry(tw, dir->fd, entry->name,
+            flags_stat | AT_SYMLINK_NOFOLLOW, type, &entry->st) < 0)) {
+        entry_error(entry, errno, entry->name);
+        return;
     }
-    if (S_ISREG(tw->st.st_mode) || should_recurse(tw)) {
-        fd = openat(dir, name, O_RDONLY | flags_open);
-        if (fd < 0) {
-            perror(name);
-            return -1;
+    if (S_ISDIR(entry->st.st_mode)) {
+        entry->dir = new_directory(tw, dir, entry);
+    } else if (S_ISREG(entry->st.st_mode) && ahead &&
+        __atomic_load_n(&tw->open_ahead, __ATOMIC_RELAXED) < OPEN_AHEAD) {
+        /* on failure, the walk opens it again and reports the error */
+        entry->fd = openat(dir->fd, entry->name, O_RDONLY | flags_open);
+        if (entry->fd >= 0)
+            __atomic_add_fetch(&tw->open_ahead, 1, __ATOMIC_RELAXED);
+    } else if (S_ISLNK(entry->st.st_mode)) {
+        ret = readlinkat(dir->fd, entry->name, target, sizeof(target));
+        if (ret < 0) {
+            entry_error(entry, errno, "readlink");
+            return;
         }
-        file->fd = fd;
-        if (S_ISDIR(tw->st.st_mode)) {
-            ret = read_directory(tw, file);
-            if (ret < 0)
-                return ret;
+        if (ret >= (ssize_t)sizeof(target)) {
+            entry_error(entry, ENAMETOOLONG, "symlink target");
+            return;
         }
+        target[ret] = 0;
+        entry->target = strdup(target);
+        if (entry->target == NULL)
+            entry_error(entry, ENOMEM, "malloc");
     }
-    if (S_ISLNK(tw->st.st_mode)) {
-        ret = readlinkat(dir, name, tw->target, sizeof(tw->target));
-        if (ret < 0) {
-            perror("readlink");
-            return -1;
+}
+
+static void
+scan_directory(Treewalk *tw, Treewalk_dir *dir, uint8_t *dents, int ahead)
+{
+    unsigned i;
+
+    if (dir->fd < 0) {
+        dir->fd = openat(dir->parent->fd, dir->name,
+            O_RDONLY | (tw->opt_follow ? 0 : O_NOFOLLOW));
+        if (dir->fd < 0) {
+            dir_error(dir, errno, dir->name);
+            return;
         }
-        if (ret >= (int)sizeof(tw->target)) {
-            fprintf(stderr, "symlink target too long\n");
+    }
+    if (read_directory(dir, dents) < 0)
+        return;
+    for (i = 0; i < dir->nb_entries; i++)
+        examine_entry(tw, dir, &dir->entries[i], ahead);
+}
+
+static void
+free_directory(Treewalk *tw, Treewalk_dir *dir)
+{
+    Treewalk_entry *entry;
+    unsigned i;
+
+    for (i = 0; i < dir->nb_entries; i++) {
+        entry = &dir->entries[i];
+        if (entry->dir != NULL)
+            free_directory(tw, entry->dir);
+        if (entry->fd >= 0) {
+            close(entry->fd);
+            __atomic_sub_fetch(&tw->open_ahead, 1, __ATOMIC_RELAXED);
+        }
+        free(entry->target);
+    }
+    free(dir->entries);
+    free(dir->all_files);
+    free(dir->path);
+    if (dir->fd >= 0)
+        close(dir->fd);
+    free(dir);
+}
+
+/* called with the mutex held */
+static void
+deque_push(Treewalk *tw, unsigned idx, Treewalk_dir *dir)
+{
+    Treewalk_deque *dq = &tw->deques[idx];
+    Treewalk_dir **dirs;
+    size_t alloc;
+
+    if (dq->tail == dq->alloc) {
+        if (dq->head > dq->alloc / 2) {
+            memmove(dq->dirs, dq->dirs + dq->head,
+                (dq->tail - dq->head) * sizeof(*dq->dirs));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            alloc = dq->alloc * 2 + 16;
+            dirs = realloc(dq->dirs, alloc * sizeof(*dirs));
+            /* the walk will scan it itself */
+            if (dirs == NULL)
+                return;
+            dq->dirs = dirs;
+            dq->alloc = alloc;
+        }
+    }
+    dq->dirs[dq->tail++] = dir;
+    dir->deque = idx;
+}
+
+/* called with the mutex held */
+static void
+deque_remove(Treewalk *tw, Treewalk_dir *dir)
+{
+    Treewalk_deque *dq;
+    size_t i;
+
+    if (dir->deque == NO_DEQUE)
+        return;
+    dq = &tw->deques[dir->deque];
+    for (i = dq->tail; i-- > dq->head;)
+        if (dq->dirs[i] == dir)
+            break;
+    memmove(dq->dirs + i, dq->dirs + i + 1,
+        (dq->tail - i - 1) * sizeof(*dq->dirs));
+    dq->tail--;
+    dir->deque = NO_DEQUE;
+}
+
+/*
+ * Called with the mutex held.
+ * The newest directory of the thread's own deque, else the newest of the
+ * walk's, which it needs first, else the oldest of another thread's.
+ */
+static Treewalk_dir *
+deque_take(Treewalk *tw, unsigned idx)
+{
+    unsigned nb = tw->nb_threads + 1, i;
+    Treewalk_deque *dq;
+    Treewalk_dir *dir;
+
+    for (i = 0; i < nb; i++) {
+        dq = &tw->deques[i == 0 ? idx : i == 1 ? tw->nb_threads :
+            (idx + i - 1) % tw->nb_threads];
+        if (dq->tail > dq->head)
+            break;
+    }
+    if (i == nb)
+        return NULL;
+    dir = i < 2 ? dq->dirs[--dq->tail] : dq->dirs[dq->head++];
+    if (dq->head == dq->tail)
+        dq->head = dq->tail = 0;
+    dir->deque = NO_DEQUE;
+    return dir;
+}
+
+/* called with the mutex held */
+static void
+scan_done(Treewalk *tw, Treewalk_dir *dir, unsigned idx)
+{
+    unsigned i, pushed = 0;
+
+    dir->state = DIR_DONE;
+    if (tw->nb_started == 0)
+        return;
+    /* in reverse order, so that the first one is taken first */
+    for (i = dir->nb_entries; i-- > 0;) {
+        if (dir->entries[i].dir != NULL) {
+            deque_push(tw, idx, dir->entries[i].dir);
+            pushed = 1;
+        }
+    }
+    if (pushed)
+        pthread_cond_broadcast(&tw->cond_work);
+}
+
+static void *
+treewalk_thread(void *th_v)
+{
+    Treewalk_thread *th = th_v;
+    Treewalk *tw = th->tw;
+    Treewalk_dir *dir;
+
+    pthread_mutex_lock(&tw->mutex);
+    while (!tw->quit) {
+        dir = tw->ahead < WALK_AHEAD ? deque_take(tw, th->idx) : NULL;
+        if (dir == NULL) {
+            pthread_cond_wait(&tw->cond_work, &tw->mutex);
+            continue;
+        }
+        dir->state = DIR_CLAIMED;
+        pthread_mutex_unlock(&tw->mutex);
+        scan_directory(tw, dir, th->dents, 1);
+        pthread_mutex_lock(&tw->mutex);
+        tw->ahead += dir->nb_entries;
+        scan_done(tw, dir, th->idx);
+        pthread_cond_broadcast(&tw->cond_done);
+    }
+    pthread_mutex_unlock(&tw->mutex);
+    return NULL;
+}
+
+static int
+enter_directory(Treewalk *tw, Treewalk_dir *dir)
+{
+    pthread_mutex_lock(&tw->mutex);
+    if (dir->state == DIR_QUEUED) {
+        /* no thread got to it yet */
+        deque_remove(tw, dir);
+        dir->state = DIR_CLAIMED;
+        pthread_mutex_unlock(&tw->mutex);
+        scan_directory(tw, dir, tw->dents, 0);
+        pthread_mutex_lock(&tw->mutex);
+        scan_done(tw, dir, tw->nb_threads);
+    } else {
+        while (dir->state != DIR_DONE)
+            pthread_cond_wait(&tw->cond_done, &tw->mutex);
+        tw->ahead -= dir->nb_entries;
+        pthread_cond_broadcast(&tw->cond_work);
+    }
+    pthread_mutex_unlock(&tw->mutex);
+    if (dir->error != 0) {
+        if (dir->error > 0) {
+            errno = dir->error;
+            perror(dir->error_what);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void
+leave_directory(Treewalk *tw, Treewalk_file *file)
+{
+    free_directory(tw, file->dir);
+    file->entry->dir = NULL;
+    file->dir = NULL;
+}
+
+static int
+treewalk_start(Treewalk *tw)
+{
+    unsigned i;
+
+    tw->started = 1;
+    tw->dents = malloc(DENTS_SIZE);
+    if (tw->dents == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (tw->nb_threads > 0) {
+        tw->threads = calloc(tw->nb_threads, sizeof(*tw->threads));
+        tw->deques = calloc(tw->nb_threads + 1, sizeof(*tw->deques));
+        if (tw->threads == NULL || tw->deques == NULL) {
+            perror("malloc");
             return -1;
         }
-        tw->target[ret] = 0;
     }
+    for (i = 0; i < tw->nb_threads; i++) {
+        tw->threads[i].tw = tw;
+        tw->threads[i].idx = i;
+        tw->threads[i].dents = malloc(DENTS_SIZE);
+        if (tw->threads[i].dents == NULL ||
+            pthread_create(&tw->threads[i].thread, NULL, treewalk_thread,
+            &tw->threads[i]) != 0)
+            break;
+        tw->nb_started++;
+    }
+    if (tw->stack[0].dir != NULL)
+        return enter_directory(tw, tw->stack[0].dir);
     return 0;
 }
 
 static int
 treewalk_open_real(Treewalk *tw, const char *path)
 {
-    int ret;
+    Treewalk_entry *root = &tw->root;
+    Treewalk_dir *dir;
+    char target[TARGET_LEN + 1];
+    ssize_t ret;
+    int fd = -1;
 
     tw->depth = 0;
     tw->path[0] = '/';
     tw->path[1] = 0;
     tw->stack[0].path_len = 0;
-    ret = examine_file(tw, AT_FDCWD, path);
-    return ret;
+    tw->stack[0].dir = NULL;
+    tw->stack[0].entry = root;
+    tw->stack[0].cur_file = 0;
+    tw->cur = root;
+    tw->fd = -1;
+    memset(root, 0, sizeof(*root));
+    root->fd = -1;
+    if (lstat(path, &root->st) < 0) {
+        perror(path);
+        return -1;
+    }
+    if (S_ISREG(root->st.st_mode) || S_ISDIR(root->st.st_mode)) {
+        fd = open(path, O_RDONLY | O_NOFOLLOW);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+    if (S_ISREG(root->st.st_mode)) {
+        tw->fd = fd;
+    } else if (S_ISDIR(root->st.st_mode)) {
+        /* scanned when the walk starts, once the options are set */
+        dir = calloc(1, sizeof(*dir));
+        if (dir != NULL)
+            dir->path = strdup("/");
+        if (dir == NULL || dir->path == NULL) {
+            perror("malloc");
+            free(dir);
+            close(fd);
+            return -1;
+        }
+        dir->deque = NO_DEQUE;
+        dir->fd = fd;
+        dir->state = DIR_QUEUED;
+        root->dir = tw->stack[0].dir = dir;
+    } else if (S_ISLNK(root->st.st_mode)) {
+        ret = readlink(path, target, sizeof(target));
+        if (ret < 0) {
+            perror("readlink");
+            return -1;
+        }
+        if (ret >= (ssize_t)sizeof(target)) {
+            fprintf(stderr, "symlink target too long\n");
+            return -1;
+        }
+        target[ret] = 0;
+        root->target = strdup(target);
+        if (root->target == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    return 0;
 }
 
 int
@@ -223,7 +737,7 @@ treewalk_open(Treewalk **rtw, const char *path)
     Treewalk *tw;
     int ret;
 
-    tw = malloc(sizeof(*tw));
+    tw = calloc(1, sizeof(*tw));
     if (tw == NULL) {
         perror("malloc");
         return -1;
@@ -236,13 +750,41 @@ treewalk_open(Treewalk **rtw, const char *path)
         free(tw);
         return ret;
     }
+    pthread_mutex_init(&tw->mutex, NULL);
+    pthread_cond_init(&tw->cond_work, NULL);
+    pthread_cond_init(&tw->cond_done, NULL);
     *rtw = tw;
     return 0;
 }
 
 void treewalk_free(Treewalk **rtw)
 {
-    free(*rtw);
+    Treewalk *tw = *rtw;
+    unsigned i;
+
+    pthread_mutex_lock(&tw->mutex);
+    tw->quit = 1;
+    pthread_cond_broadcast(&tw->cond_work);
+    pthread_mutex_unlock(&tw->mutex);
+    for (i = 0; i < tw->nb_started; i++)
+        pthread_join(tw->threads[i].thread, NULL);
+    for (i = 0; tw->threads != NULL && i < tw->nb_threads; i++)
+        free(tw->threads[i].dents);
+    free(tw->dents);
+    if (tw->root.dir != NULL)
+        free_directory(tw, tw->root.dir);
+    free(tw->root.target);
+    if (tw->fd >= 0)
+        close(tw->fd);
+    if (tw->deques != NULL)
+        for (i = 0; i <= tw->nb_threads; i++)
+            free(tw->deques[i].dirs);
+    free(tw->deques);
+    free(tw->threads);
+    pthread_mutex_destroy(&tw->mutex);
+    pthread_cond_destroy(&tw->cond_work);
+    pthread_cond_destroy(&tw->cond_done);
+    free(tw);
     *rtw = NULL;
 }
 
@@ -259,29 +801,35 @@ treewalk_set_exclude(Treewalk *tw, const char **excl, size_t nb_excl)
     tw->nb_exclude = nb_excl;
 }
 
-static void
-unexamine_file(Treewalk_file *file)
+void
+treewalk_set_threads(Treewalk *tw, unsigned nb_threads)
 {
-    free(file->all_files);
-    free(file->files);
-    file->all_files = NULL;
-    file->files = NULL;
-    file->nb_files = 0;
-    if (file->fd >= 0)
-        close(file->fd);
-    file->fd = -1;
+    tw->nb_threads = nb_threads;
+}
+
+void
+treewalk_set_dont_sync(Treewalk *tw, int val)
+{
+    tw->opt_dont_sync = val;
 }
 
 int
 treewalk_next(Treewalk *tw)
 {
     Treewalk_file *file = &tw->stack[tw->depth], *child;
-    const char *child_name;
+    Treewalk_entry *entry;
+    unsigned flags_open;
     size_t len;
-    int ret;
 
-    while (file->cur_file == file->nb_files) {
-        unexamine_file(file);
+    if (!tw->started && treewalk_start(tw) < 0)
+        return -1;
+    if (tw->fd >= 0) {
+        close(tw->fd);
+        tw->fd = -1;
+    }
+    while (file->dir == NULL || file->cur_file == file->dir->nb_entries) {
+        if (file->dir != NULL)
+            leave_directory(tw, file);
         if (tw->depth == 0)
             return 0;
         tw->depth--;
@@ -291,21 +839,46 @@ treewalk_next(Treewalk *tw)
         fprintf(stderr, "Directories too deep\n");
         return -1;
     }
-    child_name = file->files[file->cur_file];
+    entry = &file->dir->entries[file->cur_file];
     child = &tw->stack[tw->depth + 1];
-    len = strlen(child_name) + 1;
+    len = strlen(entry->name) + 1;
     if (len > PATH_LEN - file->path_len) {
         fprintf(stderr, "Path too long\n");
         return -1;
     }
     tw->path[file->path_len] = '/';
-    memcpy(tw->path + file->path_len + 1, child_name, len);
+    memcpy(tw->path + file->path_len + 1, entry->name, len);
     child->path_len = file->path_len + len;
+    child->dir = NULL;
+    child->entry = entry;
+    child->cur_file = 0;
     tw->depth++;
     file->cur_file++;
-    ret = examine_file(tw, file->fd, child_name);
-    if (ret < 0)
-        return ret;
+    tw->cur = entry;
+    if (entry->error != 0) {
+        errno = entry->error;
+        perror(entry->error_what);
+        return -1;
+    }
+    if (S_ISREG(entry->st.st_mode)) {
+        if (entry->fd >= 0) {
+            tw->fd = entry->fd;
+            entry->fd = -1;
+            __atomic_sub_fetch(&tw->open_ahead, 1, __ATOMIC_RELAXED);
+        } else {
+            flags_open = tw->opt_follow ? 0 : O_NOFOLLOW;
+            tw->fd = openat(file->dir->fd, entry->name,
+                O_RDONLY | flags_open);
+            if (tw->fd < 0) {
+                perror(entry->name);
+                return -1;
+            }
+        }
+    } else if (entry->dir != NULL) {
+        if (enter_directory(tw, entry->dir) < 0)
+            return -1;
+        child->dir = entry->dir;
+    }
     return 1;
 }
 
@@ -318,23 +891,23 @@ treewalk_get_path(const Treewalk *tw)
 const struct stat *
 treewalk_get_stat(const Treewalk *tw)
 {
-    return &tw->st;
+    return &tw->cur->st;
 }
 
 int
 treewalk_get_subtree_skipped(const Treewalk *tw)
 {
-    return tw->stack[tw->depth].subtree_skipped;
+    return tw->cur->subtree_skipped;
 }
 
 int
 treewalk_get_fd(const Treewalk *tw)
 {
-    return S_ISREG(tw->st.st_mode) ? tw->stack[tw->depth].fd : -1;
+    return S_ISREG(tw->cur->st.st_mode) ? tw->fd : -1;
 }
 
 const char *
 treewalk_readlink(const Treewalk *tw)
 {
-    return S_ISLNK(tw->st.st_mode) ? tw->target : NULL;
+    return S_ISLNK(tw->cur->st.st_mode) ? tw->cur->target : NULL;
 }
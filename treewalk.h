@@ -22,10 +22,27 @@ void treewalk_set_follow(Treewalk *tw, int val);
 
 void treewalk_set_exclude(Treewalk *tw, const char **excl, size_t nb_excl);
 
+/**
+ * Scan the directories ahead of the walk with nb_threads threads, started
+ * by the first treewalk_next(); the order of the walk is unchanged.
+ * By default, the walk scans each directory itself when it enters it.
+ */
+void treewalk_set_threads(Treewalk *tw, unsigned nb_threads);
+
+/**
+ * Let network file systems answer the stat of the entries from their
+ * cache, even if it can be stale.
+ */
+void treewalk_set_dont_sync(Treewalk *tw, int val);
+
 int treewalk_next(Treewalk *tw);
 
 const char *treewalk_get_path(const Treewalk *tw);
 
+/**
+ * Only the device, inode, type, mode and mtime are certain to be set, plus
+ * the size and number of links for regular files.
+ */
 const struct stat *treewalk_get_stat(const Treewalk *tw);
 
 int treewalk_get_fd(const Treewalk *tw);
@@ -0,0 +1,225 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE /* for syscall() and MAP_POPULATE */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct Uring {
+    int fd;
+    unsigned queued;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+int
+uring_alloc(Uring **ruring, unsigned depth)
+{
+    struct io_uring_params p;
+    Uring *uring;
+    int err;
+
+    uring = calloc(1, sizeof(*uring));
+    if (uring == NULL)
+        return -1;
+    memset(&p, 0, sizeof(p));
+    uring->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (uring->fd < 0) {
+        free(uring);
+        return -1;
+    }
+    uring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring->cq_map_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP)) {
+        if (uring->cq_map_size > uring->sq_map_size)
+            uring->sq_map_size = uring->cq_map_size;
+        uring->cq_map_size = 0;
+    }
+    uring->sq_map = mmap(NULL, uring->sq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->sq_map == MAP_FAILED)
+        goto fail;
+    if (uring->cq_map_size == 0) {
+        uring->cq_map = uring->sq_map;
+    } else {
+        uring->cq_map = mmap(NULL, uring->cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+        if (uring->cq_map == MAP_FAILED)
+            goto fail_sq;
+    }
+    uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED)
+        goto fail_cq;
+    uring->sq_head  = (void *)((char *)uring->sq_map + p.sq_off.head);
+    uring->sq_tail  = (void *)((char *)uring->sq_map + p.sq_off.tail);
+    uring->sq_mask  = (void *)((char *)uring->sq_map + p.sq_off.ring_mask);
+    uring->sq_array = (void *)((char *)uring->sq_map + p.sq_off.array);
+    uring->cq_head  = (void *)((char *)uring->cq_map + p.cq_off.head);
+    uring->cq_tail  = (void *)((char *)uring->cq_map + p.cq_off.tail);
+    uring->cq_mask  = (void *)((char *)uring->cq_map + p.cq_off.ring_mask);
+    uring->cqes     = (void *)((char *)uring->cq_map + p.cq_off.cqes);
+    *ruring = uring;
+    return 0;
+
+fail_cq:
+    if (uring->cq_map_size != 0)
+        munmap(uring->cq_map, uring->cq_map_size);
+fail_sq:
+    munmap(uring->sq_map, uring->sq_map_size);
+fail:
+    err = errno;
+    close(uring->fd);
+    free(uring);
+    errno = err;
+    return -1;
+}
+
+void
+uring_free(Uring **ruring)
+{
+    Uring *uring = *ruring;
+
+    munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_map_size != 0)
+        munmap(uring->cq_map, uring->cq_map_size);
+    munmap(uring->sq_map, uring->sq_map_size);
+    close(uring->fd);
+    free(uring);
+    *ruring = NULL;
+}
+
+void
+uring_readv(Uring *uring, int fd, const struct iovec *iov,
+    unsigned niov, uint64_t offset, uint64_t user_data)
+{
+    unsigned tail = *uring->sq_tail, idx = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = niov;
+    sqe->user_data = user_data;
+    uring->sq_array[idx] = idx;
+    /* the kernel must see the entry before the new tail */
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->queued++;
+}
+
+int
+uring_submit(Uring *uring, unsigned min_complete)
+{
+    int ret;
+
+    if (uring->queued == 0 && min_complete == 0)
+        return 0;
+    while (1) {
+        ret = syscall(__NR_io_uring_enter, uring->fd, uring->queued,
+            min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0,
+            NULL, 0);
+        if (ret >= 0)
+            break;
+        if (errno != EINTR)
+            return -1;
+    }
+    uring->queued -= ret;
+    return 0;
+}
+
+int
+uring_reap(Uring *uring, uint64_t *user_data, int *res)
+{
+    unsigned head = *uring->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    cqe = &uring->cqes[head & *uring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#else
+
+int
+uring_alloc(Uring **ruring, unsigned depth)
+{
+    (void)ruring;
+    (void)depth;
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+uring_free(Uring **ruring)
+{
+    (void)ruring;
+}
+
+void
+uring_readv(Uring *uring, int fd, const struct iovec *iov,
+    unsigned niov, uint64_t offset, uint64_t user_data)
+{
+    (void)uring;
+    (void)fd;
+    (void)iov;
+    (void)niov;
+    (void)offset;
+    (void)user_data;
+}
+
+int
+uring_submit(Uring *uring, unsigned min_complete)
+{
+    (void)uring;
+    (void)min_complete;
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uring_reap(Uring *uring, uint64_t *user_data, int *res)
+{
+    (void)uring;
+    (void)user_data;
+    (void)res;
+    return 0;
+}
+
+#endif
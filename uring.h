@@ -0,0 +1,48 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * Minimal io_uring interface for asynchronous reads, using the system
+ * calls directly; used by a single thread.
+ */
+
+typedef struct Uring Uring;
+
+/**
+ * Allocate a ring for up to depth requests in flight.
+ * Returns -1 with errno set if io_uring is not available, without
+ * printing anything.
+ */
+int uring_alloc(Uring **ruring, unsigned depth);
+
+void uring_free(Uring **ruring);
+
+/**
+ * Queue a read; it is only started by uring_submit().
+ * The iovec array must stay valid until then.
+ */
+void uring_readv(Uring *uring, int fd, const struct iovec *iov,
+    unsigned niov, uint64_t offset, uint64_t user_data);
+
+/**
+ * Start the queued requests and wait until at least min_complete
+ * requests are complete.
+ */
+int uring_submit(Uring *uring, unsigned min_complete);
+
+/**
+ * Get a completed request; returns 0 if there is none.
+ * res is the result of the read or minus an errno value.
+ */
+int uring_reap(Uring *uring, uint64_t *user_data, int *res);
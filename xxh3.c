@@ -0,0 +1,470 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "xxh3.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# define HAVE_X86_VECTORS 1
+#endif
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define STRIPE_LEN 64
+#define SECRET_SIZE 192
+#define SECRET_CONSUME_RATE 8
+#define STRIPES_PER_BLOCK ((SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define SECRET_LASTACC_START 7
+#define SECRET_MERGEACCS_START 11
+#define MIDSIZE_MAX 240
+#define MIDSIZE_STARTOFFSET 3
+#define MIDSIZE_LASTOFFSET 17
+#define SECRET_SIZE_MIN 136
+
+typedef struct Xxh128 {
+    uint64_t lo, hi;
+} Xxh128;
+
+typedef void (*Accumulate)(uint64_t *acc, const uint8_t *in,
+    const uint8_t *secret, size_t nb_stripes);
+
+static const uint8_t xxh3_secret[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+    0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+    0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+    0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+    0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+    0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+    0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+    0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+    0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static pthread_once_t xxh3_once = PTHREAD_ONCE_INIT;
+
+static Accumulate xxh3_accumulate;
+
+static inline uint32_t
+rd_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+        (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t
+rd_le64(const uint8_t *p)
+{
+    return (uint64_t)rd_le32(p) | (uint64_t)rd_le32(p + 4) << 32;
+}
+
+static inline void
+wr_be64(uint8_t *p, uint64_t v)
+{
+    unsigned i;
+
+    for (i = 0; i < 8; i++)
+        p[i] = v >> (56 - i * 8);
+}
+
+static inline uint64_t
+rotl64(uint64_t x, unsigned n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+static inline uint32_t
+rotl32(uint32_t x, unsigned n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline Xxh128
+mult64to128(uint64_t a, uint64_t b)
+{
+    unsigned __int128 p = (unsigned __int128)a * b;
+
+    return (Xxh128){ .lo = p, .hi = p >> 64 };
+}
+
+static inline uint64_t
+mul128_fold64(uint64_t a, uint64_t b)
+{
+    Xxh128 p = mult64to128(a, b);
+
+    return p.lo ^ p.hi;
+}
+
+static inline uint64_t
+xxh64_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t
+xxh3_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static Xxh128
+xxh3_len_1to3(const uint8_t *in, size_t len)
+{
+    uint32_t c1 = in[0], c2 = in[len >> 1], c3 = in[len - 1];
+    uint32_t lo = c1 << 16 | c2 << 24 | c3 | (uint32_t)len << 8;
+    uint32_t hi = rotl32(__builtin_bswap32(lo), 13);
+    uint64_t flip_lo = rd_le32(xxh3_secret) ^ rd_le32(xxh3_secret + 4);
+    uint64_t flip_hi = rd_le32(xxh3_secret + 8) ^ rd_le32(xxh3_secret + 12);
+
+    return (Xxh128){
+        .lo = xxh64_avalanche(lo ^ flip_lo),
+        .hi = xxh64_avalanche(hi ^ flip_hi),
+    };
+}
+
+static Xxh128
+xxh3_len_4to8(const uint8_t *in, size_t len)
+{
+    uint64_t in64 = rd_le32(in) + ((uint64_t)rd_le32(in + len - 4) << 32);
+    uint64_t flip = rd_le64(xxh3_secret + 16) ^ rd_le64(xxh3_secret + 24);
+    Xxh128 m = mult64to128(in64 ^ flip, PRIME64_1 + (len << 2));
+
+    m.hi += m.lo << 1;
+    m.lo ^= m.hi >> 3;
+    m.lo ^= m.lo >> 35;
+    m.lo *= PRIME_MX2;
+    m.lo ^= m.lo >> 28;
+    m.hi = xxh3_avalanche(m.hi);
+    return m;
+}
+
+static Xxh128
+xxh3_len_9to16(const uint8_t *in, size_t len)
+{
+    uint64_t flip_lo = rd_le64(xxh3_secret + 32) ^ rd_le64(xxh3_secret + 40);
+    uint64_t flip_hi = rd_le64(xxh3_secret + 48) ^ rd_le64(xxh3_secret + 56);
+    uint64_t in_lo = rd_le64(in);
+    uint64_t in_hi = rd_le64(in + len - 8);
+    Xxh128 m, h;
+
+    m = mult64to128(in_lo ^ in_hi ^ flip_lo, PRIME64_1);
+    m.lo += (uint64_t)(len - 1) << 54;
+    in_hi ^= flip_hi;
+    m.hi += in_hi + (uint64_t)(uint32_t)in_hi * (PRIME32_2 - 1);
+    m.lo ^= __builtin_bswap64(m.hi);
+    h = mult64to128(m.lo, PRIME64_2);
+    h.hi += m.hi * PRIME64_2;
+    h.lo = xxh3_avalanche(h.lo);
+    h.hi = xxh3_avalanche(h.hi);
+    return h;
+}
+
+static Xxh128
+xxh3_len_0to16(const uint8_t *in, size_t len)
+{
+    if (len > 8)
+        return xxh3_len_9to16(in, len);
+    if (len >= 4)
+        return xxh3_len_4to8(in, len);
+    if (len > 0)
+        return xxh3_len_1to3(in, len);
+    return (Xxh128){
+        .lo = xxh64_avalanche(rd_le64(xxh3_secret + 64) ^
+            rd_le64(xxh3_secret + 72)),
+        .hi = xxh64_avalanche(rd_le64(xxh3_secret + 80) ^
+            rd_le64(xxh3_secret + 88)),
+    };
+}
+
+static inline uint64_t
+xxh3_mix16(const uint8_t *in, const uint8_t *secret)
+{
+    return mul128_fold64(rd_le64(in) ^ rd_le64(secret),
+        rd_le64(in + 8) ^ rd_le64(secret + 8));
+}
+
+static inline void
+xxh3_mix32(Xxh128 *acc, const uint8_t *in1, const uint8_t *in2,
+    const uint8_t *secret)
+{
+    acc->lo += xxh3_mix16(in1, secret);
+    acc->lo ^= rd_le64(in2) + rd_le64(in2 + 8);
+    acc->hi += xxh3_mix16(in2, secret + 16);
+    acc->hi ^= rd_le64(in1) + rd_le64(in1 + 8);
+}
+
+static Xxh128
+xxh3_mid_final(Xxh128 acc, size_t len)
+{
+    Xxh128 h;
+
+    h.lo = xxh3_avalanche(acc.lo + acc.hi);
+    h.hi = -xxh3_avalanche(acc.lo * PRIME64_1 + acc.hi * PRIME64_4 +
+        len * PRIME64_2);
+    return h;
+}
+
+static Xxh128
+xxh3_len_17to128(const uint8_t *in, size_t len)
+{
+    Xxh128 acc = { .lo = len * PRIME64_1, .hi = 0 };
+
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96)
+                xxh3_mix32(&acc, in + 48, in + len - 64, xxh3_secret + 96);
+            xxh3_mix32(&acc, in + 32, in + len - 48, xxh3_secret + 64);
+        }
+        xxh3_mix32(&acc, in + 16, in + len - 32, xxh3_secret + 32);
+    }
+    xxh3_mix32(&acc, in, in + len - 16, xxh3_secret);
+    return xxh3_mid_final(acc, len);
+}
+
+static Xxh128
+xxh3_len_129to240(const uint8_t *in, size_t len)
+{
+    Xxh128 acc = { .lo = len * PRIME64_1, .hi = 0 };
+    unsigned i;
+
+    for (i = 32; i < 160; i += 32)
+        xxh3_mix32(&acc, in + i - 32, in + i - 16, xxh3_secret + i - 32);
+    acc.lo = xxh3_avalanche(acc.lo);
+    acc.hi = xxh3_avalanche(acc.hi);
+    for (i = 160; i <= len; i += 32)
+        xxh3_mix32(&acc, in + i - 32, in + i - 16,
+            xxh3_secret + MIDSIZE_STARTOFFSET + i - 160);
+    xxh3_mix32(&acc, in + len - 16, in + len - 32,
+        xxh3_secret + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET - 16);
+    return xxh3_mid_final(acc, len);
+}
+
+/*
+ * The accumulation is written once with vector extensions and compiled
+ * for each instruction set.
+ */
+#define XXH3_ACCUMULATE(suffix, target) \
+target static void \
+xxh3_accumulate_ ## suffix(uint64_t *acc, const uint8_t *in, \
+    const uint8_t *secret, size_t nb_stripes) \
+{ \
+    typedef uint64_t v8 __attribute__((vector_size(64))); \
+    v8 a, data, key; \
+    size_t n; \
+ \
+    memcpy(&a, acc, sizeof(a)); \
+    for (n = 0; n < nb_stripes; n++) { \
+        memcpy(&data, in + n * STRIPE_LEN, sizeof(data)); \
+        memcpy(&key, secret + n * SECRET_CONSUME_RATE, sizeof(key)); \
+        key ^= data; \
+        a += __builtin_shuffle(data, (v8){ 1, 0, 3, 2, 5, 4, 7, 6 }); \
+        a += (key & 0xFFFFFFFF) * (key >> 32); \
+    } \
+    memcpy(acc, &a, sizeof(a)); \
+}
+
+XXH3_ACCUMULATE(generic, )
+#ifdef HAVE_X86_VECTORS
+XXH3_ACCUMULATE(avx2, __attribute__((target("avx2"))))
+XXH3_ACCUMULATE(avx512, __attribute__((target("avx512f"))))
+#endif
+
+static void
+xxh3_scramble(uint64_t *acc)
+{
+    const uint8_t *secret = xxh3_secret + SECRET_SIZE - STRIPE_LEN;
+    unsigned i;
+
+    for (i = 0; i < 8; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= rd_le64(secret + i * 8);
+        acc[i] *= PRIME32_1;
+    }
+}
+
+static void
+xxh3_consume(uint64_t *acc, unsigned *nb_done, const uint8_t *in,
+    size_t nb_stripes)
+{
+    size_t n;
+
+    while (nb_stripes > 0) {
+        n = STRIPES_PER_BLOCK - *nb_done;
+        if (n > nb_stripes)
+            n = nb_stripes;
+        xxh3_accumulate(acc, in,
+            xxh3_secret + *nb_done * SECRET_CONSUME_RATE, n);
+        in += n * STRIPE_LEN;
+        nb_stripes -= n;
+        *nb_done += n;
+        /* there is always more input after the stripes consumed */
+        if (*nb_done == STRIPES_PER_BLOCK) {
+            xxh3_scramble(acc);
+            *nb_done = 0;
+        }
+    }
+}
+
+static uint64_t
+xxh3_merge(const uint64_t *acc, const uint8_t *secret, uint64_t start)
+{
+    unsigned i;
+
+    for (i = 0; i < 4; i++)
+        start += mul128_fold64(acc[2 * i] ^ rd_le64(secret + 16 * i),
+            acc[2 * i + 1] ^ rd_le64(secret + 16 * i + 8));
+    return xxh3_avalanche(start);
+}
+
+static void
+xxh3_setup_once(void)
+{
+    xxh3_accumulate = xxh3_accumulate_generic;
+#ifdef HAVE_X86_VECTORS
+    if (getenv("MULTIHASH_GENERIC") == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            xxh3_accumulate = xxh3_accumulate_avx512;
+        else if (__builtin_cpu_supports("avx2"))
+            xxh3_accumulate = xxh3_accumulate_avx2;
+    }
+#endif
+}
+
+void
+xxh3_setup(void)
+{
+    pthread_once(&xxh3_once, xxh3_setup_once);
+}
+
+void
+xxh3_init(Xxh3_state *s)
+{
+    static const uint64_t init[8] = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1,
+    };
+
+    memcpy(s->acc, init, sizeof(s->acc));
+    s->total_len = 0;
+    s->nb_stripes = 0;
+    s->buf_len = 0;
+}
+
+void
+xxh3_update(Xxh3_state *s, const uint8_t *buf, size_t size)
+{
+    const uint8_t *end = buf + size;
+    size_t n;
+
+    s->total_len += size;
+    /* the last byte is always kept in the buffer for the final stripe */
+    if (size <= sizeof(s->buf) - s->buf_len) {
+        memcpy(s->buf + s->buf_len, buf, size);
+        s->buf_len += size;
+        return;
+    }
+    if (s->buf_len > 0) {
+        n = sizeof(s->buf) - s->buf_len;
+        memcpy(s->buf + s->buf_len, buf, n);
+        buf += n;
+        xxh3_consume(s->acc, &s->nb_stripes, s->buf,
+            sizeof(s->buf) / STRIPE_LEN);
+        s->buf_len = 0;
+    }
+    if ((size_t)(end - buf) > sizeof(s->buf)) {
+        n = (end - 1 - buf) / STRIPE_LEN;
+        xxh3_consume(s->acc, &s->nb_stripes, buf, n);
+        buf += n * STRIPE_LEN;
+        /* the final stripe may need bytes from before the buffer */
+        memcpy(s->buf + sizeof(s->buf) - STRIPE_LEN, buf - STRIPE_LEN,
+            STRIPE_LEN);
+    }
+    memcpy(s->buf, buf, end - buf);
+    s->buf_len = end - buf;
+}
+
+void
+xxh3_final(Xxh3_state *s, uint8_t *out)
+{
+    uint8_t last[STRIPE_LEN];
+    const uint8_t *p;
+    uint64_t acc[8];
+    unsigned nb_stripes = s->nb_stripes;
+    size_t n;
+    Xxh128 h;
+
+    if (s->total_len <= 16) {
+        h = xxh3_len_0to16(s->buf, s->total_len);
+    } else if (s->total_len <= 128) {
+        h = xxh3_len_17to128(s->buf, s->total_len);
+    } else if (s->total_len <= MIDSIZE_MAX) {
+        h = xxh3_len_129to240(s->buf, s->total_len);
+    } else {
+        memcpy(acc, s->acc, sizeof(acc));
+        if (s->buf_len >= STRIPE_LEN) {
+            xxh3_consume(acc, &nb_stripes, s->buf,
+                (s->buf_len - 1) / STRIPE_LEN);
+            p = s->buf + s->buf_len - STRIPE_LEN;
+        } else {
+            n = STRIPE_LEN - s->buf_len;
+            memcpy(last, s->buf + sizeof(s->buf) - n, n);
+            memcpy(last + n, s->buf, s->buf_len);
+            p = last;
+        }
+        xxh3_accumulate(acc, p, xxh3_secret + SECRET_SIZE - STRIPE_LEN -
+            SECRET_LASTACC_START, 1);
+        h.lo = xxh3_merge(acc, xxh3_secret + SECRET_MERGEACCS_START,
+            s->total_len * PRIME64_1);
+        h.hi = xxh3_merge(acc, xxh3_secret + SECRET_SIZE - sizeof(acc) -
+            SECRET_MERGEACCS_START, ~(s->total_len * PRIME64_2));
+    }
+    wr_be64(out, h.hi);
+    wr_be64(out + 8, h.lo);
+}
@@ -0,0 +1,41 @@
+/*
+ * multihash - compute hashes on collections of files
+ * Copyright (c) 2017 Nicolas George <george@nsup.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ */
+
+/*
+ * XXH3 with a 128-bits output, default secret and seed 0: fast, but not
+ * a cryptographic hash.
+ */
+
+typedef struct Xxh3_state {
+    uint64_t acc[8];
+    uint64_t total_len;
+    unsigned nb_stripes;
+    unsigned buf_len;
+    uint8_t buf[256];
+} Xxh3_state;
+
+/**
+ * Select the best implementation for the running CPU;
+ * must be called before the other functions, can be called several times.
+ */
+void xxh3_setup(void);
+
+void xxh3_init(Xxh3_state *s);
+
+void xxh3_update(Xxh3_state *s, const uint8_t *buf, size_t size);
+
+/**
+ * Store the digest in canonical form, big-endian high half first.
+ */
+void xxh3_final(Xxh3_state *s, uint8_t *out);